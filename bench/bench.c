@@ -0,0 +1,940 @@
+// (c) Copyright 2020, Sean Connelly (@velipso), sean.cm
+// MIT License
+// Project Home: https://github.com/velipso/nightmare
+
+// render cost benchmarks and engine checks, built against the engine's translation unit so
+// internals can be timed and reached directly -- `make bench` from the top of the repo builds and
+// runs it
+// output is one tab-separated line per measurement, so runs can be diffed between releases:
+//   layout         <struct>            bytes
+//   voice          <voice_id>/<count>  ns per k-block, for count notes of a voice
+//   voicespercore  <voice_id>          notes of the voice one core renders in real time
+//   quality        <voice_id>/<tier>   ns per k-block, for 32 notes at each nm_quality tier below
+//                                      NM_Q_STEAL
+//   render         <mix>/<outsize>     ns per k-block of nm_render called with outsize frames
+//   reverb         <quality>           ns per k-block
+//   sampler        <speed>/<method>    ns per k-block of one note at NM_SS_2X..4X, read from the
+//                                      decimated table, or resampled on the fly with the cubic or
+//                                      with the table's windowed sinc
+//   alias          <speed>/<method>    dB of the loudest alias, relative to a passband tone of the
+//                                      same level, for the same three methods
+//   misses         <mix>/<cache>       L1 data or last level cache misses per k-block of the same mix
+//                                      as render, from the CPU's counters -- `unavailable` where the
+//                                      kernel exposes none (common in VMs and containers)
+//   chord          <layout>/<notes>    ns per k-block to generate and envelope a chord of voice 1002,
+//                                      with each note's samples in one vector (the shipped
+//                                      poly_render), or the notes side by side in vector lanes
+// built with NM_STATS (`make bench STATS=1`), render also reports what nm_stats saw:
+//   stats          <mix>/<outsize>/max      ns of the slowest k-block
+//   stats          <mix>/<outsize>/<voice>  ns per avoice render of the voice
+//
+// it also checks that optimizations didn't change the audio, by rendering a fixed scenario per voice
+// (a clip in every oscscale, sequenced and timestamped live notes, x swept under held notes, every
+// note released into silence, strips, and reverb) -- the references live in bench/golden, and
+// `make check` compares against them:
+//   bench reference <dir>                          render them into dir, from a known good build
+//   bench compare <dir> [maxabs [rms [spectral]]]  render them again and compare to dir
+// compare prints `golden <voice> <maxabs> <rms> <spectral dB> ok|FAIL`, where spectral
+// is the largest difference in any bin of the averaged power spectrum, and exits with 1 if any
+// scenario is over the tolerances (by default, tiny enough to only allow rounding changes)
+// both modes also render every voice in chunks of 1, 199, 200, 201, and 4800 frames, and nm_bounce
+// chunks of 199, 201, and 4800, which must be sample-identical to one whole render, and print
+// `chunk <voice>/[bounce]<size> ok|FAIL`
+//
+//   bench filter  sweep x over each oscillator voice's filter, and null the control rate filter
+//                 against one redesigned every sample, printing `filter <voice> <maxabs> <rms dB>
+//                 ok|FAIL` -- built with -DNM_FILTER_RATE=1 it must be bit-identical, otherwise
+//                 it must null below -80 dB
+//   bench stream  (NM_THREADS) play a streamed sample at every nm_samplespeed with the decoder
+//                 keeping up, which must match reading the whole sample as a table with nothing
+//                 starved, then with a decoder too slow for 1x, which must starve, stay silent
+//                 for exactly the starved frames, and still end on time -- printing `stream
+//                 <speed>/<frames fed per block> <starved frames> <maxabs> ok|FAIL`
+
+#include "../src/nightmare.c"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static nm_ctx_st ctx;
+
+static void report(const char *name, const char *variant, double ns){
+	printf("%s\t%s\t%.0f\n", name, variant, ns);
+}
+
+static void bench_reverb(bool low){
+	nm_clear(&ctx);
+	nm_reverb_setlow(&ctx, low);
+	nm_block_st out;
+	uint32_t seed = 1;
+	const int warm = 500;
+	const int blocks = 20000;
+	double t0 = 0;
+	for (int b = 0; b < warm + blocks; b++){
+		if (b == warm)
+			t0 = nowsec();
+		for (int i = 0; i < NM_K; i++){
+			seed = seed * 1664525 + 1013904223;
+			ctx.send.L[i] = (int32_t)seed * (0.1f / 2147483648.0f);
+			ctx.send.R[i] = -ctx.send.L[i];
+		}
+		reverb_block(&ctx, &out, true);
+	}
+	report("reverb", low ? "low" : "high", (nowsec() - t0) * 1e9 / blocks);
+}
+
+// time fn over enough k-blocks to take about a quarter second, after a warm up
+static double time_blocks(void (*fn)(void *), void *user){
+	for (int b = 0; b < 50; b++)
+		fn(user);
+	int blocks = 0;
+	double t0 = nowsec();
+	double t;
+	do {
+		for (int b = 0; b < 50; b++)
+			fn(user);
+		blocks += 50;
+		t = nowsec() - t0;
+	} while (t < 0.25);
+	return t * 1e9 / blocks;
+}
+
+// clip 0 plays `count` held notes of the voice (all on channel 0, no reverb send)
+static void start_notes(int voice_id, int count){
+	nm_clear(&ctx);
+	nm_clip_setvoice(&ctx, 0, voice_id);
+	nm_clip_setoscscale(&ctx, 0, NM_OS_CHROMATICLOW);
+	for (int i = 0; i < count; i++)
+		nm_clip_noteon(&ctx, 0, i % 48, 100);
+}
+
+static void render_block(void *user){
+	static nm_sample_st out[NM_K];
+	nm_render(&ctx, out, NM_K);
+}
+
+static void bench_voices(){
+	static const int counts[] = { 1, 8, 32 };
+	for (size_t v = 0; v < VOICES_SIZE; v++){
+		const nm_voice_st *voice = nm_voices[v];
+		if (voice->vtype != NM_VT_POLY)
+			continue; // only poly voices hold notes so far
+		double per = 0;
+		for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++){
+			start_notes(voice->voice_id, counts[c]);
+			double ns = time_blocks(render_block, NULL);
+			char variant[32];
+			snprintf(variant, sizeof(variant), "%d/%d", voice->voice_id, counts[c]);
+			report("voice", variant, ns);
+			per = ns / counts[c];
+		}
+		// a k-block lasts NM_K / 48000 seconds, and the most notes measured amortize the mix best
+		char variant[32];
+		snprintf(variant, sizeof(variant), "%d", voice->voice_id);
+		printf("voicespercore\t%s\t%.1f\n", variant, NM_K * 1e9 / 48000.0 / per);
+	}
+}
+
+// what the governor's tiers save
+static void bench_quality(){
+	for (size_t v = 0; v < VOICES_SIZE; v++){
+		const nm_voice_st *voice = nm_voices[v];
+		if (voice->vtype != NM_VT_POLY)
+			continue;
+		for (int q = NM_Q_FULL; q < NM_Q_STEAL; q++){
+			start_notes(voice->voice_id, 32);
+			nm_setquality(&ctx, q);
+			double ns = time_blocks(render_block, NULL);
+			char variant[32];
+			snprintf(variant, sizeof(variant), "%d/%d", voice->voice_id, q);
+			report("quality", variant, ns);
+		}
+	}
+}
+
+// poly_render vectorizes each note across the block's samples -- the other layout puts the notes
+// in lanes, so every step of the curve runs for the whole chord at once, padded to CHORD_LANES
+#define CHORD_UNISON 5
+#define CHORD_LANES  8
+
+_Static_assert(sizeof(((v1002_vst *)0)->ang[0]) == sizeof(float) * CHORD_UNISON,
+	"CHORD_UNISON doesn't match voice 1002");
+
+typedef struct {
+	int notes;
+	float ang[CHORD_LANES][CHORD_UNISON];
+	float dang[CHORD_LANES];
+	envelope_st env[CHORD_LANES];
+	float lang[CHORD_UNISON][CHORD_LANES];
+	float ldang[CHORD_UNISON][CHORD_LANES];
+	float mono[NM_K];
+} chord_st;
+
+static void chord_start(chord_st *c, int notes){
+	memset(c, 0, sizeof(*c));
+	c->notes = notes;
+	v1002_vst vu;
+	memset(&vu, 0, sizeof(vu));
+	for (int k = 0; k < notes; k++)
+		v1002_poly_noteon(&vu, NULL, k * 4, k, 110.0f * powf(2.0f, k * 4 / 12.0f), 1, 0.5f, 0.5f);
+	for (int k = 0; k < notes; k++){
+		memcpy(c->ang[k], vu.ang[k], sizeof(c->ang[k]));
+		c->dang[k] = vu.dang[k];
+		c->env[k] = vu.env[k];
+		float dang[CHORD_UNISON];
+		v1002_detune(dang, vu.dang[k], 0.5f);
+		for (int u = 0; u < CHORD_UNISON; u++){
+			c->lang[u][k] = vu.ang[k][u];
+			c->ldang[u][k] = dang[u];
+		}
+	}
+	// empty lanes step like a note, so their curve stays finite, and are silenced by the envelope
+	for (int k = notes; k < CHORD_LANES; k++){
+		for (int u = 0; u < CHORD_UNISON; u++)
+			c->ldang[u][k] = 0.01f;
+	}
+}
+
+static void chord_samples(void *user){
+	chord_st *c = user;
+	memset(c->mono, 0, sizeof(c->mono));
+	for (int k = 0; k < c->notes; k++){
+		float envb[NM_K];
+		envelope_block(&c->env[k], envb, NM_K);
+		float w[NM_K];
+		v1002_generate(w, c->ang[k], c->dang[k], NM_K, 0.5f, 0, NM_Q_FULL);
+		for (int i = 0; i < NM_K; i++)
+			c->mono[i] += w[i] * envb[i];
+	}
+}
+
+static void chord_notes(void *user){
+	chord_st *c = user;
+	float envt[NM_K][CHORD_LANES];
+	memset(envt, 0, sizeof(envt));
+	for (int k = 0; k < c->notes; k++){
+		float envb[NM_K];
+		envelope_block(&c->env[k], envb, NM_K);
+		for (int i = 0; i < NM_K; i++)
+			envt[i][k] = envb[i];
+	}
+	float acc[NM_K][CHORD_LANES];
+	memset(acc, 0, sizeof(acc));
+	for (int u = 0; u < CHORD_UNISON; u++){
+		float *lang = c->lang[u];
+		const float *step = c->ldang[u];
+		float istep[CHORD_LANES];
+		for (int k = 0; k < CHORD_LANES; k++)
+			istep[k] = 1.0f / step[k];
+		for (int n = 0; n < NM_K; n++){
+			for (int k = 0; k < CHORD_LANES; k++){
+				float ang = lang[k] + n * step[k];
+				ang -= (float)(int)ang;
+				acc[n][k] += osc_saw_blep(ang, step[k], istep[k]) * envt[n][k];
+			}
+		}
+		for (int k = 0; k < CHORD_LANES; k++){
+			float ang = lang[k] + NM_K * step[k];
+			lang[k] = ang - (float)(int)ang;
+		}
+	}
+	for (int n = 0; n < NM_K; n++){
+		float sum = 0;
+		for (int k = 0; k < CHORD_LANES; k++)
+			sum += acc[n][k];
+		c->mono[n] = sum;
+	}
+}
+
+static void bench_chord(){
+	static chord_st a, b;
+	static const int counts[] = { 1, 3, 6 };
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++){
+		// both layouts must make the same chord before their times mean anything
+		chord_start(&a, counts[c]);
+		chord_start(&b, counts[c]);
+		float err = 0;
+		for (int blk = 0; blk < 100; blk++){
+			chord_samples(&a);
+			chord_notes(&b);
+			for (int i = 0; i < NM_K; i++)
+				err = maxf(err, absf(a.mono[i] - b.mono[i]));
+		}
+		char variant[32];
+		if (err > 1e-4f){
+			snprintf(variant, sizeof(variant), "notes/%d", counts[c]);
+			printf("chord\t%s\tFAIL %g\n", variant, err);
+			continue;
+		}
+		snprintf(variant, sizeof(variant), "samples/%d", counts[c]);
+		report("chord", variant, time_blocks(chord_samples, &a));
+		snprintf(variant, sizeof(variant), "notes/%d", counts[c]);
+		report("chord", variant, time_blocks(chord_notes, &b));
+	}
+}
+
+typedef struct {
+	nm_sample_st *out;
+	int outsize;
+} render_args_st;
+
+//
+// SAMPLER
+//
+
+// a second of two equal tones, one that stays in the passband at every speed, and one that folds
+// back once sped up (to 20kHz at 2x, 6kHz at 3x, 8kHz at 4x)
+#define SAMPLER_FRAMES  48000
+#define SAMPLER_PASS    1000.0
+#define SAMPLER_FOLD    14000.0
+
+static sample_st sampler_smp;
+
+typedef struct {
+	sampler_st sm;
+	int factor;
+	int sinc; // resample with the windowed sinc, instead of sm
+	uint32_t m; // next output frame, for sinc
+	float L[NM_K];
+	float R[NM_K];
+} sampler_args_st;
+
+// what building the tables does, but one k-block at a time while playing
+static void sampler_sinc(sampler_args_st *a){
+	enum { HALF_MAX = 16 * 4 };
+	float h[HALF_MAX * 2 + 1];
+	int half = 16 * a->factor;
+	float fc = 0.45f / a->factor;
+	float sum = 0;
+	for (int k = -half; k <= half; k++){
+		float sinc = k == 0 ? 2.0f * fc : sinf(TAU * fc * k) / (TAU * 0.5f * k);
+		float w = 0.42f + 0.5f * cosf(TAU * 0.5f * k / half) + 0.08f * cosf(TAU * k / half);
+		h[k + half] = sinc * w;
+		sum += sinc * w;
+	}
+	const nm_sample_st *src = &sample_arena[sampler_smp.offset];
+	for (int i = 0; i < NM_K; i++){
+		int64_t c = (int64_t)(a->m + i) * a->factor;
+		float L = 0, R = 0;
+		for (int k = -half; k <= half; k++){
+			int64_t j = c + k;
+			if (j < 0 || j >= sampler_smp.size)
+				continue;
+			L += h[k + half] * src[j].L;
+			R += h[k + half] * src[j].R;
+		}
+		a->L[i] += L / sum;
+		a->R[i] += R / sum;
+	}
+	a->m += NM_K;
+}
+
+static void sampler_block(void *user){
+	sampler_args_st *a = user;
+	if ((a->sm.pos >> 32) + NM_K * 4 >= a->sm.size || a->m * a->factor + NM_K * 4 >= SAMPLER_FRAMES){
+		a->sm.pos = 0; // loop, for timing
+		a->m = 0;
+	}
+	if (a->sinc){
+		sampler_sinc(a);
+		a->sm.pos += a->sm.step * NM_K;
+	}
+	else
+		sampler_table(&a->sm, a->L, a->R, NM_K, 1, 0);
+}
+
+// amplitude of freq in buf, with a Hann window so the other tone doesn't leak into it
+static double sampler_level(const float *buf, int size, double freq){
+	double re = 0, im = 0;
+	for (int i = 0; i < size; i++){
+		double w = 0.5 - 0.5 * cos(TAU * i / size);
+		re += w * buf[i] * cos(TAU * freq * i / 48000.0);
+		im -= w * buf[i] * sin(TAU * freq * i / 48000.0);
+	}
+	return sqrt(re * re + im * im);
+}
+
+static void bench_sampler(){
+	if (sampler_smp.size == 0){
+		if (!sample_reserve(&sampler_smp, sample_mipframes(SAMPLER_FRAMES)))
+			return;
+		sampler_smp.size = SAMPLER_FRAMES;
+		for (int j = 0; j < SAMPLER_FRAMES; j++){
+			float v = 0.4f * sinf(TAU * SAMPLER_PASS * j / 48000.0) +
+				0.4f * sinf(TAU * SAMPLER_FOLD * j / 48000.0);
+			sample_arena[sampler_smp.offset + j] = (nm_sample_st){ v, v };
+		}
+		sample_mips(&sampler_smp);
+	}
+	static const char *methods[] = { "table", "cubic", "sinc" };
+	static float out[NM_K * 40];
+	for (int speed = NM_SS_2X; speed <= NM_SS_4X; speed++){
+		int f = samplespeed_num[speed];
+		double cost[3];
+		double alias[3];
+		for (int m = 0; m < 3; m++){
+			sampler_args_st a = { .factor = f, .sinc = m == 2 };
+			if (m == 0)
+				sampler_start(&a.sm, &sampler_smp, speed);
+			else{
+				a.sm.data = &sample_arena[sampler_smp.offset];
+				a.sm.size = sampler_smp.size;
+				a.sm.step = (uint64_t)f << 32;
+			}
+			cost[m] = time_blocks(sampler_block, &a);
+
+			// away from the edges, so the window only sees steady tones
+			a.sm.pos = (uint64_t)(NM_K * 10) << 32;
+			a.m = NM_K * 10;
+			for (int b = 0; b < 40; b++){
+				memset(a.L, 0, sizeof(a.L));
+				sampler_block(&a);
+				memcpy(&out[b * NM_K], a.L, sizeof(a.L));
+			}
+			double pass = sampler_level(out, NM_K * 40, SAMPLER_PASS * f);
+			double fold = fabs(SAMPLER_FOLD * f - 48000.0 * round(SAMPLER_FOLD * f / 48000.0));
+			alias[m] = 20 * log10(sampler_level(out, NM_K * 40, fold) / pass);
+		}
+		for (int m = 0; m < 3; m++){
+			char variant[32];
+			snprintf(variant, sizeof(variant), "%dx/%s", f, methods[m]);
+			report("sampler", variant, cost[m]);
+		}
+		for (int m = 0; m < 3; m++){
+			char variant[32];
+			snprintf(variant, sizeof(variant), "%dx/%s", f, methods[m]);
+			printf("alias\t%s\t%.1f\n", variant, alias[m]);
+		}
+	}
+}
+
+static void render_frames(void *user){
+	render_args_st *a = user;
+	nm_render(&ctx, a->out, a->outsize);
+}
+
+// a mix of every voice through a few strips with reverb, rendered in sizes that don't line up with
+// k-blocks, so kbuf is exercised
+static void start_mix(){
+	nm_clear(&ctx);
+	for (int clip = 0; clip < 4; clip++){
+		const nm_voice_st *voice = nm_voices[clip % VOICES_SIZE];
+		nm_clip_setvoice(&ctx, clip, voice->voice_id);
+		nm_clip_setout(&ctx, clip, clip % NM_CHANNELS_MAX);
+		nm_channel_setreverb(&ctx, clip % NM_CHANNELS_MAX, 30);
+		for (int i = 0; i < 4; i++){
+			// sample voices pick the sample with the note
+			int note = voice->vtype == NM_VT_SAMPLE ? i : clip * 5 + i * 3;
+			nm_clip_noteon(&ctx, clip, note, 100);
+		}
+	}
+}
+
+static void bench_render(){
+	static nm_sample_st out[4096];
+	static const int sizes[] = { 1, 64, 199, 200, 256, 441, 480, 1024, 4096 };
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+		start_mix();
+		render_args_st a = { out, sizes[s] };
+		// time_blocks counts calls, so scale to per k-block
+		double ns = time_blocks(render_frames, &a) * NM_K / sizes[s];
+		char variant[32];
+		snprintf(variant, sizeof(variant), "mix16/%d", sizes[s]);
+		report("render", variant, ns);
+		#ifdef NM_STATS
+		nm_stats_st st = nm_stats(&ctx);
+		snprintf(variant, sizeof(variant), "mix16/%d/max", sizes[s]);
+		report("stats", variant, st.block_ns_max);
+		for (int v = 0; v < st.voices_size; v++){
+			if (st.voices[v].renders == 0)
+				continue;
+			snprintf(variant, sizeof(variant), "mix16/%d/%d", sizes[s], st.voices[v].voice_id);
+			report("stats", variant, st.voices[v].ns / st.voices[v].renders);
+		}
+		#endif
+	}
+}
+
+#ifdef __linux__
+static int misses_open(uint32_t type, uint64_t config){
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static void bench_misses(){
+	static const char *names[] = { "l1d", "llc" };
+	for (int c = 0; c < 2; c++){
+		char variant[32];
+		snprintf(variant, sizeof(variant), "mix16/%s", names[c]);
+		#ifdef __linux__
+		int fd = c == 0
+			? misses_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+			: misses_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+		if (fd >= 0){
+			start_mix();
+			const int blocks = 2000;
+			for (int b = 0; b < 50; b++)
+				render_block(NULL);
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			for (int b = 0; b < blocks; b++)
+				render_block(NULL);
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			uint64_t count = 0;
+			bool ok = read(fd, &count, sizeof(count)) == sizeof(count);
+			close(fd);
+			if (ok){
+				printf("misses\t%s\t%.1f\n", variant, (double)count / blocks);
+				continue;
+			}
+		}
+		#endif
+		printf("misses\t%s\tunavailable\n", variant);
+	}
+}
+
+static void bench_layout(){
+	printf("layout\tctx\t%zu\n", sizeof(nm_ctx_st));
+	printf("layout\tavoice\t%zu\n", sizeof(ctx.avoices[0]));
+	printf("layout\tavnotes\t%zu\n", sizeof(ctx.avnotes[0]));
+	printf("layout\tvdata\t%zu\n", sizeof(ctx.vdata[0]));
+}
+
+//
+// GOLDEN
+//
+
+#define GOLDEN_FRAMES 60000
+#define GOLDEN_CLIPS  7       // one per oscscale
+#define GOLDEN_SWEEP  (NM_K * 4) // frames between changes of x
+#define GOLDEN_SWEEPS 60      // after which x holds, while the notes die away
+
+static nm_sample_st golden_out[GOLDEN_FRAMES];
+static nm_sample_st golden_ref[GOLDEN_FRAMES];
+
+// clip 0 plays a sequenced line, and the other clips play live notes timestamped in the middle of
+// blocks, on strips with their own pan and reverb -- clip 1 holds its note to the end, so a voice
+// that decays while held goes quiet without being released, and the others are all released early
+// enough to finish
+// x changes land between k-blocks with nothing left in the kbuf, and everything else happens at
+// fixed sample times, so chunking can't matter -- nor can rendering the chunks with nm_bounce
+static void golden_render(const nm_voice_st *voice, int chunk, bool bounce, nm_sample_st *out){
+	bool sample = voice->vtype == NM_VT_SAMPLE;
+	nm_clear(&ctx);
+	memset(out, 0, sizeof(nm_sample_st) * GOLDEN_FRAMES);
+	for (int clip = 0; clip < GOLDEN_CLIPS; clip++){
+		nm_clip_setvoice(&ctx, clip, voice->voice_id);
+		nm_clip_setoscscale(&ctx, clip, clip);
+		nm_clip_setout(&ctx, clip, clip % NM_CHANNELS_MAX);
+		nm_clip_sety(&ctx, clip, 20 + clip * 10);
+	}
+	for (int ch = 0; ch < NM_CHANNELS_MAX; ch++){
+		nm_channel_setpan(&ctx, ch, ch * 40 - 100);
+		nm_channel_setreverb(&ctx, ch, ch * 15);
+	}
+	// sample voices pick the sample with the note
+	for (int i = 0; i < 6; i++){
+		int y = sample ? i % 5 : (i * 5) % 14;
+		nm_clip_setnote(&ctx, 0, i, (nm_note_st){
+			.x1 = i, .y1 = y, .x2 = i + 1 + i % 2, .y2 = y, .velocity = 100
+		});
+	}
+	nm_song_play(&ctx);
+	nm_clip_noteon_at(&ctx, 1234, 1, sample ? 0 : 3, 90);
+	for (int clip = 2; clip < GOLDEN_CLIPS; clip++){
+		uint64_t time = 1234 + clip * 5333;
+		int note = sample ? clip % 5 : clip * 2;
+		nm_clip_noteon_at(&ctx, time, clip, note, 90);
+		nm_clip_noteoff_at(&ctx, time + 9000, clip, note, 0);
+	}
+	for (int pos = 0; pos < GOLDEN_FRAMES; ){
+		int sweep = pos / GOLDEN_SWEEP;
+		if (pos % GOLDEN_SWEEP == 0 && sweep < GOLDEN_SWEEPS){
+			// up and down the whole range every 24 changes
+			int t = sweep % 24;
+			int x = (t < 12 ? t : 24 - t) * 100 / 12;
+			for (int clip = 0; clip < GOLDEN_CLIPS; clip++)
+				nm_clip_setx(&ctx, clip, x);
+		}
+		int end = mini(mini(pos + chunk, (sweep + 1) * GOLDEN_SWEEP), GOLDEN_FRAMES);
+		if (bounce)
+			nm_bounce(&ctx, out + pos, end - pos, NULL, NULL);
+		else
+			nm_render(&ctx, out + pos, end - pos);
+		pos = end;
+	}
+}
+
+static void golden_path(char *path, size_t size, const char *dir, int voice_id){
+	snprintf(path, size, "%s/%d.f32", dir, voice_id);
+}
+
+// in-place radix-2 FFT
+static void fft(double *re, double *im, int n){
+	for (int i = 1, j = 0; i < n; i++){
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j){
+			double t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+	for (int len = 2; len <= n; len <<= 1){
+		double ang = -2 * M_PI / len;
+		for (int i = 0; i < n; i += len){
+			for (int k = 0; k < len / 2; k++){
+				double wr = cos(ang * k), wi = sin(ang * k);
+				double xr = re[i + k + len / 2] * wr - im[i + k + len / 2] * wi;
+				double xi = re[i + k + len / 2] * wi + im[i + k + len / 2] * wr;
+				re[i + k + len / 2] = re[i + k] - xr;
+				im[i + k + len / 2] = im[i + k] - xi;
+				re[i + k] += xr;
+				im[i + k] += xi;
+			}
+		}
+	}
+}
+
+#define SPECTRUM_N 1024
+
+// power spectrum of the mid channel, averaged over Hann windowed frames
+static void spectrum(const nm_sample_st *buf, double *power){
+	static double re[SPECTRUM_N], im[SPECTRUM_N];
+	memset(power, 0, sizeof(double) * (SPECTRUM_N / 2 + 1));
+	for (int f = 0; f + SPECTRUM_N <= GOLDEN_FRAMES; f += SPECTRUM_N){
+		for (int i = 0; i < SPECTRUM_N; i++){
+			double w = 0.5 - 0.5 * cos(2 * M_PI * i / SPECTRUM_N);
+			re[i] = w * (buf[f + i].L + buf[f + i].R) * 0.5;
+			im[i] = 0;
+		}
+		fft(re, im, SPECTRUM_N);
+		for (int i = 0; i <= SPECTRUM_N / 2; i++)
+			power[i] += re[i] * re[i] + im[i] * im[i];
+	}
+}
+
+// largest difference in dB between two spectra, ignoring bins that are silent (below -120dB) in
+// both
+static double spectral_diff(const nm_sample_st *a, const nm_sample_st *b){
+	static double pa[SPECTRUM_N / 2 + 1], pb[SPECTRUM_N / 2 + 1];
+	spectrum(a, pa);
+	spectrum(b, pb);
+	const double floor = 1e-12 * SPECTRUM_N * SPECTRUM_N * (GOLDEN_FRAMES / SPECTRUM_N);
+	double worst = 0;
+	for (int i = 0; i <= SPECTRUM_N / 2; i++){
+		double d = fabs(10 * log10((pa[i] + floor) / (pb[i] + floor)));
+		if (d > worst)
+			worst = d;
+	}
+	return worst;
+}
+
+static bool golden_chunks(){
+	static const int chunks[] = { 1, 199, 200, 201, 4800 };
+	static const int bounces[] = { 199, 201, 4800 };
+	bool ok = true;
+	for (size_t v = 0; v < VOICES_SIZE; v++){
+		const nm_voice_st *voice = nm_voices[v];
+		golden_render(voice, GOLDEN_FRAMES, false, golden_ref);
+		for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++){
+			golden_render(voice, chunks[c], false, golden_out);
+			bool same = memcmp(golden_out, golden_ref, sizeof(golden_out)) == 0;
+			printf("chunk\t%d/%d\t%s\n", voice->voice_id, chunks[c], same ? "ok" : "FAIL");
+			ok = ok && same;
+		}
+		for (size_t c = 0; c < sizeof(bounces) / sizeof(bounces[0]); c++){
+			golden_render(voice, bounces[c], true, golden_out);
+			bool same = memcmp(golden_out, golden_ref, sizeof(golden_out)) == 0;
+			printf("chunk\t%d/bounce%d\t%s\n", voice->voice_id, bounces[c], same ? "ok" : "FAIL");
+			ok = ok && same;
+		}
+	}
+	return ok;
+}
+
+static bool golden_reference(const char *dir){
+	char path[1024];
+	for (size_t v = 0; v < VOICES_SIZE; v++){
+		const nm_voice_st *voice = nm_voices[v];
+		golden_render(voice, GOLDEN_FRAMES, false, golden_out);
+		golden_path(path, sizeof(path), dir, voice->voice_id);
+		FILE *fp = fopen(path, "wb");
+		if (fp == NULL || fwrite(golden_out, sizeof(golden_out), 1, fp) != 1){
+			fprintf(stderr, "failed to write %s\n", path);
+			if (fp)
+				fclose(fp);
+			return false;
+		}
+		fclose(fp);
+	}
+	return golden_chunks();
+}
+
+static bool golden_compare(const char *dir, double tol_maxabs, double tol_rms, double tol_spectral){
+	char path[1024];
+	bool ok = true;
+	for (size_t v = 0; v < VOICES_SIZE; v++){
+		const nm_voice_st *voice = nm_voices[v];
+		golden_path(path, sizeof(path), dir, voice->voice_id);
+		FILE *fp = fopen(path, "rb");
+		bool read = fp && fread(golden_ref, sizeof(golden_ref), 1, fp) == 1;
+		if (fp)
+			fclose(fp);
+		if (!read){
+			fprintf(stderr, "failed to read %s\n", path);
+			ok = false;
+			continue;
+		}
+		golden_render(voice, GOLDEN_FRAMES, false, golden_out);
+		double maxabs = 0, sum = 0;
+		for (int i = 0; i < GOLDEN_FRAMES; i++){
+			double dl = golden_out[i].L - golden_ref[i].L;
+			double dr = golden_out[i].R - golden_ref[i].R;
+			maxabs = fmax(maxabs, fmax(fabs(dl), fabs(dr)));
+			sum += dl * dl + dr * dr;
+		}
+		double rms = sqrt(sum / (GOLDEN_FRAMES * 2));
+		double spectral = spectral_diff(golden_out, golden_ref);
+		// NaN fails every comparison, so check for passing
+		bool pass = maxabs <= tol_maxabs && rms <= tol_rms && spectral <= tol_spectral;
+		printf("golden\t%d\t%g\t%g\t%g\t%s\n", voice->voice_id, maxabs, rms, spectral,
+			pass ? "ok" : "FAIL");
+		ok = ok && pass;
+	}
+	return golden_chunks() && ok;
+}
+
+//
+// FILTER
+//
+
+#define FILTER_VOICES(X)  X(1001) X(1002)
+#define FILTER_FRAMES     48000
+
+static float filter_in[FILTER_FRAMES];
+static float filter_out[FILTER_FRAMES];
+
+// sweep x from 0 to 1 and y from 1 to 0 over the frames, a k-block at a time like a voice does
+#define FILTER_CHECK(id)                                                                   \
+	static bool filter_check_##id(){                                                       \
+		biquad_st bq;                                                                      \
+		memset(&bq, 0, sizeof(bq));                                                        \
+		v##id##_filter_at(&bq, 0, 1);                                                      \
+		biquad_st ref = bq;                                                                \
+		float mono[NM_K];                                                                  \
+		float outR[NM_K];                                                                  \
+		const float d = 1.0f / FILTER_FRAMES;                                              \
+		double maxabs = 0, err = 0, sig = 0;                                               \
+		memset(filter_out, 0, sizeof(filter_out));                                         \
+		for (int i = 0; i < FILTER_FRAMES; i += NM_K){                                     \
+			const float x = i * d;                                                         \
+			memcpy(mono, &filter_in[i], sizeof(mono));                                     \
+			v##id##_output(&filter_out[i], outR, mono, NM_K, &bq, 1, 0, x, d, 1 - x, -d,   \
+				NM_Q_FULL);                                                                \
+			for (int j = 0; j < NM_K; j++){                                                \
+				v##id##_filter_at(&ref, x + d * j, 1 - x - d * j);                         \
+				const double r = biquad_step(&ref, filter_in[i + j]);                      \
+				const double e = fabs(filter_out[i + j] - r);                              \
+				maxabs = e > maxabs ? e : maxabs;                                          \
+				err += e * e;                                                              \
+				sig += r * r;                                                              \
+			}                                                                              \
+		}                                                                                  \
+		const double db = err > 0 ? 10 * log10(err / sig) : -INFINITY;                     \
+		const bool ok = NM_FILTER_RATE == 1 ? maxabs == 0 : db < -80;                      \
+		printf("filter\t%d\t%g\t%.1f\t%s\n", id, maxabs, db, ok ? "ok" : "FAIL");        \
+		return ok;                                                                         \
+	}
+FILTER_VOICES(FILTER_CHECK)
+#undef FILTER_CHECK
+
+static bool filter_check(){
+	uint32_t seed = 1;
+	for (int i = 0; i < FILTER_FRAMES; i++){
+		seed = seed * 1664525 + 1013904223;
+		filter_in[i] = (int32_t)seed * (0.5f / 2147483648.0f);
+	}
+	bool ok = true;
+	#define FILTER_CALL(id)  ok = filter_check_##id() && ok;
+	FILTER_VOICES(FILTER_CALL)
+	#undef FILTER_CALL
+	return ok;
+}
+
+//
+// STREAM
+//
+
+#ifdef NM_THREADS
+#define STREAM_SIZE   (48000 * 2)
+#define STREAM_TABLE  13 // note of the sample as a table
+#define STREAM_NOTE   14 // note of the same sample, streamed
+
+static nm_sample_st stream_out[STREAM_SIZE * 4 + NM_K * 2];
+static nm_sample_st stream_ref[STREAM_SIZE * 4 + NM_K * 2];
+
+// never zero, so silence in the output can only be starved frames
+static nm_sample_st stream_signal(uint32_t j){
+	return (nm_sample_st){
+		0.25f + 0.2f * sinf(j * 0.01f) + 0.04f * sinf(j * 0.37f),
+		0.25f + 0.2f * cosf(j * 0.013f)
+	};
+}
+
+// what the decoder thread does, inline so the test is deterministic -- give every playing stream up
+// to `frames` more frames
+static void stream_feed(int frames){
+	for (int i = 0; i < NM_STREAMS_MAX; i++){
+		stream_st *st = &streams[i];
+		if (atomic_load(&st->state) != STREAM_PLAY)
+			continue;
+		unsigned read = atomic_load(&st->read);
+		unsigned write = atomic_load(&st->write);
+		if (write < read)
+			write = read;
+		int n = mini(mini(frames, NM_STREAM_FRAMES - (write - read)), st->smp->size - write);
+		for (int j = 0; j < n; j++)
+			st->ring[(write + j) % NM_STREAM_FRAMES] = stream_signal(write + j);
+		atomic_store(&st->write, write + n);
+	}
+}
+
+static bool stream_case(nm_samplespeed speed, int feed){
+	nm_stream_stats_st st0 = nm_stream_stats();
+	nm_clear(&ctx);
+	nm_clip_setvoice(&ctx, 0, 1003);
+	nm_clip_setsamplespeed(&ctx, 0, speed);
+	nm_clip_noteon(&ctx, 0, STREAM_NOTE, 100);
+	// frames until the sampler steps past the end, at its fixed point rate
+	const uint64_t step = ((uint64_t)samplespeed_num[speed] << 32) / samplespeed_den[speed];
+	const int frames = (((uint64_t)STREAM_SIZE << 32) + step - 1) / step;
+	const int blocks = frames / NM_K + 2;
+	memset(stream_out, 0, sizeof(stream_out));
+	for (int b = 0; b < blocks; b++){
+		nm_render(&ctx, &stream_out[b * NM_K], NM_K);
+		stream_feed(feed);
+	}
+	nm_stream_stats_st st1 = nm_stream_stats();
+	unsigned starved = st1.starved_frames - st0.starved_frames;
+	bool ok = ctx.active_size == 0 && st1.active == 0;
+
+	// the same frames read as a raw table, at the same rate and volume (0.5, velocity 1)
+	const sample_st *smp = &sample_bank[vabout_index(vabout_find(1003))][STREAM_TABLE];
+	sampler_st sm = {
+		.data = &sample_arena[smp->offset],
+		.size = smp->size,
+		.step = step
+	};
+	float L[NM_K], R[NM_K];
+	for (int b = 0; b < blocks; b++){
+		memset(L, 0, sizeof(L));
+		memset(R, 0, sizeof(R));
+		sampler_table(&sm, L, R, NM_K, 0.5f, 0);
+		for (int i = 0; i < NM_K; i++)
+			stream_ref[b * NM_K + i] = (nm_sample_st){ L[i], R[i] };
+	}
+
+	// starved frames are silent, everything else plays on time, and nothing plays past the end
+	double maxabs = 0;
+	unsigned silent = 0;
+	for (int i = 0; i < blocks * NM_K; i++){
+		if (stream_out[i].L == 0 && stream_out[i].R == 0){
+			if (i < frames)
+				silent++;
+			continue;
+		}
+		if (i >= frames)
+			ok = false;
+		maxabs = fmax(maxabs, fabs(stream_out[i].L - stream_ref[i].L));
+		maxabs = fmax(maxabs, fabs(stream_out[i].R - stream_ref[i].R));
+	}
+	if (feed >= NM_K * samplespeed_num[speed])
+		ok = ok && starved == 0 && maxabs == 0 && silent == 0;
+	else
+		ok = ok && starved > 0 && silent == starved && maxabs == 0;
+
+	char variant[32];
+	snprintf(variant, sizeof(variant), "%d/%d", speed, feed);
+	printf("stream\t%s\t%u\t%g\t%s\n", variant, starved, maxabs, ok ? "ok" : "FAIL");
+	return ok;
+}
+
+static bool stream_check(){
+	// one sample, stored once as a table and once as a stream with only its head in the arena
+	sample_st *bank = sample_bank[vabout_index(vabout_find(1003))];
+	sample_st *table = &bank[STREAM_TABLE];
+	sample_st *stream = &bank[STREAM_NOTE];
+	if (!sample_reserve(table, sample_mipframes(STREAM_SIZE)) ||
+		!sample_reserve(stream, NM_STREAM_HEAD)){
+		printf("stream\tarena\tFAIL\n");
+		return false;
+	}
+	table->size = STREAM_SIZE;
+	for (uint32_t j = 0; j < STREAM_SIZE; j++)
+		sample_arena[table->offset + j] = stream_signal(j);
+	sample_mips(table);
+	stream->stream = true;
+	stream->size = STREAM_SIZE;
+	stream->head = NM_STREAM_HEAD;
+	memcpy(&sample_arena[stream->offset], &sample_arena[table->offset],
+		sizeof(nm_sample_st) * NM_STREAM_HEAD);
+
+	bool ok = true;
+	for (int speed = NM_SS_1_4X; speed <= NM_SS_4X; speed++)
+		ok = stream_case(speed, NM_STREAM_FRAMES) && ok;
+	ok = stream_case(NM_SS_1X, NM_K * 3 / 4) && ok;
+	return ok;
+}
+#endif
+
+int main(int argc, char **argv){
+	nm_init(NULL);
+	if (argc >= 3 && strcmp(argv[1], "reference") == 0)
+		return golden_reference(argv[2]) ? 0 : 1;
+	if (argc >= 3 && strcmp(argv[1], "compare") == 0){
+		return golden_compare(argv[2],
+			argc >= 4 ? atof(argv[3]) : 1e-5,
+			argc >= 5 ? atof(argv[4]) : 1e-6,
+			argc >= 6 ? atof(argv[5]) : 0.01) ? 0 : 1;
+	}
+	if (argc >= 2 && strcmp(argv[1], "filter") == 0)
+		return filter_check() ? 0 : 1;
+	if (argc >= 2 && strcmp(argv[1], "stream") == 0){
+		#ifdef NM_THREADS
+		return stream_check() ? 0 : 1;
+		#else
+		fprintf(stderr, "stream needs a build with NM_THREADS\n");
+		return 1;
+		#endif
+	}
+	if (argc >= 2){
+		fprintf(stderr, "usage: %s [reference <dir> | compare <dir> [maxabs [rms [spectral]]] | "
+			"filter | stream]\n", argv[0]);
+		return 1;
+	}
+	bench_layout();
+	bench_misses();
+	bench_voices();
+	bench_quality();
+	bench_chord();
+	bench_render();
+	bench_reverb(false);
+	bench_reverb(true);
+	bench_sampler();
+	return 0;
+}
@@ -5,7 +5,15 @@
 #include "nightmare.h"
 #include <math.h>
 #include <string.h>
+#include <stdio.h>
 #include <opusfile.h>
+#include <time.h>
+#ifdef NM_THREADS
+#include <sched.h>
+#endif
+#if defined(NM_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 
 static const float TAU = 6.283185307179586476925286766559005768394338798750211641949f;
 
@@ -15,8 +23,18 @@ typedef void (*build_f)(
 	float x,
 	float y
 );
-typedef bool (*render_f)(
-	nm_sample_st *buf,
+
+// what a voice did with a block
+enum {
+	RENDER_DONE,  // finished, so the avoice can be freed
+	RENDER_WROTE, // added itself to the buffers
+	RENDER_QUIET  // still playing, but below NM_SILENCE, so it left the buffers alone
+};
+
+typedef int (*render_f)(
+	float *bufL,
+	float *bufR,
+	int size, // NM_K, unless the block is split by events
 	void *vu, // voice data
 	void *cu, // clip data
 	float volume,
@@ -24,22 +42,46 @@ typedef bool (*render_f)(
 	float x,
 	float dx,
 	float y,
-	float dy
+	float dy,
+	int quality // nm_quality
+);
+typedef bool (*poly_noteon_f)( // returns false if a voice that plays chords has no room left
+	void *vu, // voice data
+	void *cu, // clip data
+	int note,
+	int id, // tells the note apart from others on the avoice, even ones with the same pitch
+	float freq,
+	float velocity,
+	float x,
+	float y
+);
+typedef void (*poly_noteoff_f)(
+	void *vu, // voice data
+	void *cu, // clip data
+	int note,
+	int id, // the id the note was started with
+	float freq
 );
-typedef void (*poly_noteon_f)();
-typedef void (*poly_noteoff_f)();
 typedef void (*mono_noteon_f)();
 typedef void (*mono_notepush_f)();
 typedef void (*mono_notepop_f)();
 typedef void (*mono_noteoff_f)();
-typedef void (*sample_noteon_f)();
-typedef void (*sample_noteoff_f)();
+typedef bool (*sample_noteon_f)( // returns false if there's nothing to play
+	void *vu, // voice data
+	void *cu, // clip data
+	const void *smp, // sample_st picked by the note
+	nm_samplespeed speed,
+	float velocity,
+	float x,
+	float y
+);
+typedef void (*sample_noteoff_f)(
+	void *vu, // voice data
+	void *cu  // clip data
+);
 
 typedef struct {
-	#ifndef NDEBUG
-	size_t vdata_size;
-	size_t cdata_size;
-	#endif
+	int chord; // notes one avoice plays at once
 	build_f f_build;
 	render_f f_render;
 	union {
@@ -101,6 +143,71 @@ static inline float minf(float a, float b){
 	return a > b ? b : a;
 }
 
+// largest magnitude in buf, for checking against NM_SILENCE
+static inline float peakf(const float *buf, int size){
+	float peak = 0;
+	for (int i = 0; i < size; i++)
+		peak = maxf(peak, absf(buf[i]));
+	return peak;
+}
+
+// sinf(ang * TAU) for ang in [0, 1) without branches, so it vectorizes -- folds the phase into a
+// quarter wave and evaluates the Taylor series to z^9 (max error ~4e-6)
+static inline float osc_sine(float ang){
+	float x = 0.5f - ang;
+	float a = absf(x);
+	float z = TAU * copysignf(minf(a, 0.5f - a), x);
+	float z2 = z * z;
+	return z * (1.0f + z2 * (-1.0f / 6.0f + z2 * (1.0f / 120.0f + z2 * (-1.0f / 5040.0f +
+		z2 * (1.0f / 362880.0f)))));
+}
+
+// polyBLEP residual for a step from -1 to 1 at phase 0, where t is the phase and idt is samples per
+// cycle -- added to a curve's rising edges and subtracted from its falling edges, it band-limits the
+// edge by rounding off the sample on each side of it
+static inline float osc_blep(float t, float idt){
+	float a = t * idt;          // samples since the edge
+	float b = (t - 1.0f) * idt; // samples until the next edge, negative
+	float after = a < 1.0f ? a + a - a * a - 1.0f : 0.0f;
+	float before = b > -1.0f ? b * b + b + b + 1.0f : 0.0f;
+	return after + before;
+}
+
+// polyBLAMP residual for the slope increasing by 1 per sample at phase 0, i.e., the polyBLEP
+// integrated, which band-limits corners
+static inline float osc_blamp(float t, float idt){
+	float a = minf(t * idt, 1.0f);
+	float b = maxf((t - 1.0f) * idt, -1.0f);
+	float a1 = 1.0f - a;
+	float b1 = b + 1.0f;
+	return (a1 * a1 * a1 + b1 * b1 * b1) * (1.0f / 6.0f);
+}
+
+// the curves of osc.c with their discontinuities band-limited, so they don't need oversampling --
+// phases are in [0, 1), and dt is the phase increment per sample
+static inline float osc_square_blep(float ang, float duty, float dt, float idt){
+	float rise = ang - duty + 1.0f;
+	rise -= (float)(int)rise;
+	return 2.0f * (float)(int)(ang - duty + 1.0f) - 1.0f +
+		osc_blep(rise, idt) - osc_blep(ang, idt);
+}
+
+static inline float osc_saw_blep(float ang, float dt, float idt){
+	float t = ang + 0.5f;
+	t -= (float)(int)t;
+	return 2.0f * t - 1.0f - osc_blep(t, idt);
+}
+
+static inline float osc_triangle_blamp(float ang, float dt, float idt){
+	// trough at 0.75, where the slope goes from -4 to 4 cycles, and peak at 0.25
+	float trough = ang + 0.25f;
+	trough -= (float)(int)trough;
+	float peak = ang + 0.75f;
+	peak -= (float)(int)peak;
+	return 1.0f - 4.0f * absf(ang - 0.25f - (float)(int)(ang + 0.25f)) +
+		8.0f * dt * (osc_blamp(trough, idt) - osc_blamp(peak, idt));
+}
+
 //
 // BIQUAD FILTER
 //
@@ -111,17 +218,22 @@ typedef struct {
 	float b2;
 	float a1;
 	float a2;
-	nm_sample_st xn1;
-	nm_sample_st xn2;
-	nm_sample_st yn1;
-	nm_sample_st yn2;
+	float db0; // per-sample deltas while gliding between coefficients
+	float db1;
+	float db2;
+	float da1;
+	float da2;
+	float xn1;
+	float xn2;
+	float yn1;
+	float yn2;
 } biquad_st;
 
 static inline void biquad_reset(biquad_st *bq){
-	bq->xn1 = (nm_sample_st){ 0, 0 };
-	bq->xn2 = (nm_sample_st){ 0, 0 };
-	bq->yn1 = (nm_sample_st){ 0, 0 };
-	bq->yn2 = (nm_sample_st){ 0, 0 };
+	bq->xn1 = 0;
+	bq->xn2 = 0;
+	bq->yn1 = 0;
+	bq->yn2 = 0;
 }
 
 static inline void biquad_scale(biquad_st *bq, float amt){
@@ -284,19 +396,57 @@ static inline void biquad_highshelf(biquad_st *bq, float freq, float Q, float ga
 	}
 }
 
-static inline nm_sample_st biquad_step(biquad_st *bq, nm_sample_st in){
-	nm_sample_st out = {
-		bq->b0 * in.L +
-		bq->b1 * bq->xn1.L +
-		bq->b2 * bq->xn2.L -
-		bq->a1 * bq->yn1.L -
-		bq->a2 * bq->yn2.L,
-		bq->b0 * in.R +
-		bq->b1 * bq->xn1.R +
-		bq->b2 * bq->xn2.R -
-		bq->a1 * bq->yn1.R -
-		bq->a2 * bq->yn2.R
-	};
+// glide from the current coefficients to target's coefficients over the next `steps` calls to
+// biquad_glidestep -- since the stable region of (a1, a2) is a triangle (convex), every point on the
+// line between two stable filters is also stable, so the resonance can't blow up mid-glide
+static inline void biquad_glide(biquad_st *bq, const biquad_st *target, int steps){
+	float inv = 1.0f / steps;
+	bq->db0 = (target->b0 - bq->b0) * inv;
+	bq->db1 = (target->b1 - bq->b1) * inv;
+	bq->db2 = (target->b2 - bq->b2) * inv;
+	bq->da1 = (target->a1 - bq->a1) * inv;
+	bq->da2 = (target->a2 - bq->a2) * inv;
+}
+
+static inline void biquad_glidestep(biquad_st *bq){
+	bq->b0 += bq->db0;
+	bq->b1 += bq->db1;
+	bq->b2 += bq->db2;
+	bq->a1 += bq->da1;
+	bq->a2 += bq->da2;
+}
+
+// the filter has rung out if its history is below NM_SILENCE
+static inline bool biquad_quiet(const biquad_st *bq){
+	return maxf(maxf(absf(bq->xn1), absf(bq->xn2)), maxf(absf(bq->yn1), absf(bq->yn2))) <
+		NM_SILENCE;
+}
+
+// stop gliding, keeping the current coefficients
+static inline void biquad_hold(biquad_st *bq){
+	bq->db0 = 0;
+	bq->db1 = 0;
+	bq->db2 = 0;
+	bq->da1 = 0;
+	bq->da2 = 0;
+}
+
+// stop a quiet filter mid-glide and flush its history, so it wakes up clean once the caller sets
+// the coefficients it should have by then
+static inline void biquad_sleep(biquad_st *bq){
+	biquad_reset(bq);
+	biquad_hold(bq);
+}
+
+// one channel, so mono sources (every oscillator voice) only pay for one -- stereo sources run a
+// biquad per side
+static inline float biquad_step(biquad_st *bq, float in){
+	float out =
+		bq->b0 * in +
+		bq->b1 * bq->xn1 +
+		bq->b2 * bq->xn2 -
+		bq->a1 * bq->yn1 -
+		bq->a2 * bq->yn2;
 	bq->xn2 = bq->xn1;
 	bq->xn1 = in;
 	bq->yn2 = bq->yn1;
@@ -308,126 +458,676 @@ static inline nm_sample_st biquad_step(biquad_st *bq, nm_sample_st in){
 // OVERSAMPLE
 //
 
-typedef struct {
-	float b0;
-	float a1;
-	float a2;
-	float xn1;
-	float xn2;
-	float yn1;
-	float yn2;
-} oversample_st;
-
-static inline void oversample_make(oversample_st *os, int factor){
-	float omega = TAU / (factor * 2.0f);
-	float cs = cosf(omega);
-	float alpha = sinf(omega) * 1.154700538379252f; // 2/sqrt(3)
-	float a0inv = 1.0f / (1.0f + alpha);
-	os->b0 = a0inv * (1.0f - cs) * 0.5f;
-	os->a1 = a0inv * -2.0f * cs;
-	os->a2 = a0inv * (1.0f - alpha);
-	os->xn1 = 0;
-	os->xn2 = 0;
-	os->yn1 = 0;
-	os->yn2 = 0;
-}
-
-static inline float oversample_step(oversample_st *os, float v){
-	float out = os->b0 * (v + os->xn1 * 2.0f + os->xn2) - os->yn1 * os->a1 - os->yn2 * os->a2;
-	os->xn2 = os->xn1;
-	os->xn1 = v;
-	os->yn2 = os->yn1;
-	os->yn1 = out;
-	return out;
+// oversampled oscillators come back down to 48kHz through a cascade of half-band FIR decimators,
+// each halving the sample rate -- half-band filters have every other tap zero except the center,
+// which is 0.5, so only one side of the remaining (symmetric) taps is stored
+//
+// the final 2x -> 1x stage is flat to 18kHz and down -90dB from 30kHz, earlier stages have a much
+// wider transition band to work with, so they get away with fewer taps
+
+#define HALFBAND_EARLY_K  7
+#define HALFBAND_FINAL_K  12
+#define HALFBAND_SIZE_MAX (NM_K * 16) // largest input block (16x oversampling)
+
+// history per stage, in floats: 2K - 1 even samples, and K odd samples for the center tap
+#define HALFBAND_HIST(K)  (3 * (K) - 1)
+
+static const float halfband_early[HALFBAND_EARLY_K] = {
+	 3.113578667e-01f, -8.672567811e-02f,  3.586742013e-02f, -1.411791827e-02f,
+	 4.522692323e-03f, -9.616546925e-04f,  5.727194192e-05f
+};
+
+static const float halfband_final[HALFBAND_FINAL_K] = {
+	 3.157623650e-01f, -9.868553389e-02f,  5.197829073e-02f, -3.042428524e-02f,
+	 1.801250321e-02f, -1.034208482e-02f,  5.596659005e-03f, -2.776657329e-03f,
+	 1.218251042e-03f, -4.449982165e-04f,  1.181455324e-04f, -1.265502037e-05f
+};
+
+// polyphase form: the center tap only ever sees odd samples, and the rest only even samples, so the
+// input is split into its two phases, after which every tap is a unit-stride pass over the block
+//
+// decimate `size` samples from `in` into `size / 2` samples at `out`, carrying HALFBAND_HIST(K)
+// floats of history in `hist`
+static inline void halfband_decimate(float *hist, const float *h, int K, const float *in,
+	int size, float *restrict out){
+	int histev = 2 * K - 1;
+	int histod = K;
+	int outsize = size / 2;
+	float ev[2 * HALFBAND_FINAL_K - 1 + HALFBAND_SIZE_MAX / 2];
+	float od[HALFBAND_FINAL_K + HALFBAND_SIZE_MAX / 2];
+	memcpy(ev, hist, sizeof(float) * histev);
+	memcpy(od, &hist[histev], sizeof(float) * histod);
+	for (int k = 0; k < outsize; k++){
+		ev[histev + k] = in[2 * k];
+		od[histod + k] = in[2 * k + 1];
+	}
+	for (int m = 0; m < outsize; m++)
+		out[m] = 0.5f * od[m];
+	for (int j = 0; j < K; j++){
+		const float hj = h[j];
+		const float *restrict e1 = &ev[K - 1 - j];
+		const float *restrict e2 = &ev[K + j];
+		for (int m = 0; m < outsize; m++)
+			out[m] += hj * (e1[m] + e2[m]);
+	}
+	memcpy(hist, &ev[outsize], sizeof(float) * histev);
+	memcpy(&hist[histev], &od[outsize], sizeof(float) * histod);
 }
 
 //
 // ENVELOPE
 //
 
+// stages are precomputed into sample counts, and each stage is a segment of the form:
+//   v[i] = tgt + e * mul^i + i * dv
+// linear segments have tgt = 0, mul = 1, and exponential segments have dv = 0, so both shapes fill
+// a block with the same straight-line loop and nothing is recomputed per sample
+
+enum {
+	ENVELOPE_LINEAR,
+	ENVELOPE_EXP // exponential decay and release
+};
+
+enum {
+	ENV_WAIT,
+	ENV_ATTACK,
+	ENV_HOLD,
+	ENV_DECAY,
+	ENV_SUSTAIN,
+	ENV_RELEASE,
+	ENV_DONE
+};
+
 typedef struct {
-	float wait;
-	float attack;
-	float hold;
-	float decay;
+	int wait;
+	int attack;
+	int hold;
+	int decay;
+	int release;
 	float sustain;
-	float release;
-	float last;
-	int sample;
-	bool released;
+	int curve;
+	int stage;
+	int left; // samples left in the stage, or -1 if it lasts forever
+	float v;
+	float tgt;
+	float mul;
+	float dv;
 } envelope_st;
 
-static inline void envelope_make(envelope_st *env, float wait, float attack, float hold,
-	float decay, float sustain, float release){
-	env->wait = wait;
-	env->attack = attack;
-	env->hold = hold;
-	env->decay = decay;
-	env->sustain = sustain;
-	env->release = release;
-	env->last = 0;
-	env->sample = 0;
-	env->released = false;
+static inline int envelope_samples(float sec){
+	return (int)(sec * 48000.0f + 0.5f);
 }
 
-static inline void envelope_reset(envelope_st *env){
-	env->last = 0;
-	env->sample = 0;
-	env->released = false;
+static inline void envelope_segment(envelope_st *env, float from, float to, int size, int curve){
+	env->v = from;
+	env->left = size;
+	if (curve == ENVELOPE_EXP){
+		// reach -60dB of the distance by the end of the segment, then snap to the target
+		env->tgt = to;
+		env->mul = powf(0.001f, 1.0f / size);
+		env->dv = 0;
+	}
+	else{
+		env->tgt = 0;
+		env->mul = 1;
+		env->dv = (to - from) / size;
+	}
 }
 
-static inline float envelope_step(envelope_st *env){
-	float time = env->sample++ / 48000.0f;
-	float v = 0;
-	if (env->released){
-		if (time < env->release)
-			v = env->last * (1 - time / env->release);
-		else
-			v = 0;
+// enter a stage, skipping any that are zero length
+static inline void envelope_enter(envelope_st *env, int stage){
+	for (;; stage++){
+		env->stage = stage;
+		switch (stage){
+			case ENV_WAIT:
+				envelope_segment(env, 0, 0, env->wait, ENVELOPE_LINEAR);
+				break;
+			case ENV_ATTACK:
+				envelope_segment(env, 0, 1, env->attack, ENVELOPE_LINEAR);
+				break;
+			case ENV_HOLD:
+				envelope_segment(env, 1, 1, env->hold, ENVELOPE_LINEAR);
+				break;
+			case ENV_DECAY:
+				envelope_segment(env, 1, env->sustain, env->decay, env->curve);
+				break;
+			case ENV_SUSTAIN:
+				envelope_segment(env, env->sustain, env->sustain, 1, ENVELOPE_LINEAR);
+				env->left = -1;
+				return;
+			case ENV_RELEASE:
+				// starts from wherever the envelope currently is
+				envelope_segment(env, env->v, 0, env->release, env->curve);
+				break;
+			default:
+				envelope_segment(env, 0, 0, 1, ENVELOPE_LINEAR);
+				env->stage = ENV_DONE;
+				env->left = -1;
+				return;
+		}
+		if (env->left > 0)
+			return;
 	}
-	else{
-		float t2 = env->wait + env->attack;
-		float t3 = t2 + env->hold;
-		float t4 = t3 + env->decay;
-		if (time < env->wait)
-			v = 0;
-		else if (time < t2)
-			v = (time - env->wait) / env->attack;
-		else if (time < t3)
-			v = 1;
-		else if (time < t4)
-			v = env->sustain + (1 - env->sustain) * (t4 - time) / env->decay;
+}
+
+static inline void envelope_reset(envelope_st *env){
+	envelope_enter(env, ENV_WAIT);
+}
+
+static inline void envelope_make(envelope_st *env, float wait, float attack, float hold,
+	float decay, float sustain, float release, int curve){
+	env->wait = envelope_samples(wait);
+	env->attack = envelope_samples(attack);
+	env->hold = envelope_samples(hold);
+	env->decay = envelope_samples(decay);
+	env->release = envelope_samples(release);
+	env->sustain = sustain;
+	env->curve = curve;
+	envelope_reset(env);
+}
+
+static inline void envelope_block(envelope_st *env, float *out, int size){
+	for (int i = 0; i < size; ){
+		int n = env->left < 0 ? size - i : mini(size - i, env->left);
+		const float tgt = env->tgt;
+		const float dv = env->dv;
+		float pw[8];
+		pw[0] = 1;
+		for (int j = 1; j < 8; j++)
+			pw[j] = pw[j - 1] * env->mul;
+		const float mul8 = pw[7] * env->mul;
+		float e = env->v - tgt;
+		int k = 0;
+		for (; k + 8 <= n; k += 8){
+			for (int j = 0; j < 8; j++)
+				out[i + k + j] = tgt + e * pw[j] + (float)(k + j) * dv;
+			e *= mul8;
+		}
+		for (int j = 0; k + j < n; j++)
+			out[i + k + j] = tgt + e * pw[j] + (float)(k + j) * dv;
+		i += n;
+		if (env->left < 0)
+			continue;
+		env->left -= n;
+		if (env->left > 0)
+			env->v = tgt + e * pw[n - k] + (float)n * dv;
 		else
-			v = env->sustain;
-		env->last = v;
+			envelope_enter(env, env->stage + 1);
 	}
-	return v;
 }
 
 static inline void envelope_release(envelope_st *env){
-	env->sample = 0;
-	env->released = true;
+	if (env->stage < ENV_RELEASE)
+		envelope_enter(env, ENV_RELEASE);
 }
 
 static inline bool envelope_done(envelope_st *env){
-	return env->released && env->sample / 48000.0f >= env->release;
+	return env->stage == ENV_DONE;
+}
+
+//
+// SAMPLES
+//
+
+// every sample is decoded once at nm_init into one static arena, and voices read straight out of
+// it by offset/size, so playing a note never allocates or decodes
+//
+// next to each sample, the arena also holds it low-passed and decimated by 2, 3, and 4, so playing
+// at NM_SS_2X..4X is a plain table read (one frame per output frame) with no aliasing, and slower
+// speeds interpolate the original with a cubic
+//
+// streamed samples only keep their first NM_STREAM_HEAD frames in the arena, so a note starts
+// right away while the decoder thread fills a ring with the rest -- they have no decimated tables,
+// so every speed but 1x is read with the cubic
+
+typedef struct {
+	uint32_t offset;
+	uint32_t size;
+	uint32_t mip[3]; // offsets of the tables decimated by 2, 3, and 4
+	uint32_t frames; // arena frames used, including the tables
+	bool loaded;
+	#ifdef NM_THREADS
+	bool stream;
+	uint32_t head; // frames at offset, for a streamed sample
+	OggOpusFile *of; // kept open for streaming, only touched by the decoder thread after nm_init
+	ogg_int64_t of_pos;
+	#endif
+} sample_st;
+
+static nm_sample_st sample_arena[NM_SAMPLES_FRAMES];
+static uint32_t sample_arena_size = 0;
+
+// playback rate of each nm_samplespeed
+static const int samplespeed_num[] = { 1, 1, 1, 1, 2, 3, 4 };
+static const int samplespeed_den[] = { 4, 3, 2, 1, 1, 1, 1 };
+
+static inline uint32_t sample_mipsize(uint32_t size, int factor){
+	return (size + factor - 1) / factor;
+}
+
+// low-pass and decimate by factor -- only ever runs at load time, so a long Blackman-windowed sinc
+// is affordable
+static void sample_decimate(const nm_sample_st *src, uint32_t size, int factor, nm_sample_st *dst){
+	enum { HALF_MAX = 16 * 4 };
+	float h[HALF_MAX * 2 + 1];
+	int half = 16 * factor;
+	float fc = 0.45f / factor; // cutoff as a fraction of the sample rate, leaving a transition band
+	float sum = 0;
+	for (int k = -half; k <= half; k++){
+		float sinc = k == 0 ? 2.0f * fc : sinf(TAU * fc * k) / (TAU * 0.5f * k);
+		float w = 0.42f + 0.5f * cosf(TAU * 0.5f * k / half) + 0.08f * cosf(TAU * k / half);
+		h[k + half] = sinc * w;
+		sum += sinc * w;
+	}
+	for (int k = 0; k <= half * 2; k++)
+		h[k] /= sum;
+	uint32_t dsize = sample_mipsize(size, factor);
+	for (uint32_t m = 0; m < dsize; m++){
+		int64_t c = (int64_t)m * factor;
+		nm_sample_st v = { 0, 0 };
+		for (int k = -half; k <= half; k++){
+			int64_t j = c + k;
+			if (j < 0 || j >= size)
+				continue;
+			v.L += h[k + half] * src[j].L;
+			v.R += h[k + half] * src[j].R;
+		}
+		dst[m] = v;
+	}
+}
+
+// reserve arena frames for smp, returns false if they don't fit
+static bool sample_reserve(sample_st *smp, uint64_t frames){
+	if (frames > NM_SAMPLES_FRAMES - sample_arena_size)
+		return false;
+	smp->offset = sample_arena_size;
+	smp->frames = frames;
+	sample_arena_size += frames;
+	return true;
+}
+
+static inline uint64_t sample_mipframes(uint32_t size){
+	return (uint64_t)size + sample_mipsize(size, 2) + sample_mipsize(size, 3) +
+		sample_mipsize(size, 4);
+}
+
+// fill in the decimated tables of a sample reserved with sample_mipframes
+static void sample_mips(sample_st *smp){
+	uint32_t next = smp->offset + smp->size;
+	for (int f = 2; f <= 4; f++){
+		smp->mip[f - 2] = next;
+		sample_decimate(&sample_arena[smp->offset], smp->size, f, &sample_arena[next]);
+		next += sample_mipsize(smp->size, f);
+	}
+}
+
+static uint32_t sample_decode(OggOpusFile *of, nm_sample_st *out, uint32_t size){
+	uint32_t got = 0;
+	while (got < size){
+		int read = op_read_float_stereo(of, (float *)&out[got], (size - got) * 2);
+		if (read <= 0)
+			break;
+		got += read;
+	}
+	return got;
+}
+
+static bool sample_load(sample_st *smp, const char *path){
+	int err;
+	OggOpusFile *of = op_open_file(path, &err);
+	if (!of)
+		return false;
+	ogg_int64_t total = op_pcm_total(of, -1);
+	if (total < 0 || total > UINT32_MAX){
+		op_free(of);
+		return false;
+	}
+	smp->size = total;
+	#ifdef NM_THREADS
+	if (total > NM_STREAM_MIN){
+		if (!sample_reserve(smp, NM_STREAM_HEAD)){
+			op_free(of);
+			return false;
+		}
+		smp->stream = true;
+		smp->of = of;
+		smp->head = sample_decode(of, &sample_arena[smp->offset], NM_STREAM_HEAD);
+		smp->of_pos = smp->head;
+		return smp->head == NM_STREAM_HEAD;
+	}
+	#endif
+	if (!sample_reserve(smp, sample_mipframes(total))){
+		op_free(of);
+		return false;
+	}
+	uint32_t got = sample_decode(of, &sample_arena[smp->offset], total);
+	op_free(of);
+	sample_mips(smp);
+	return got == total;
+}
+
+// undo a failed sample_load, giving its frames back to the arena -- it's always the last sample
+// that reserved any, since samples load one at a time
+static void sample_unload(sample_st *smp){
+	sample_arena_size -= smp->frames;
+	#ifdef NM_THREADS
+	if (smp->of)
+		op_free(smp->of);
+	#endif
+	memset(smp, 0, sizeof(sample_st));
+}
+
+#ifdef NM_THREADS
+#if NM_STREAM_FRAMES & (NM_STREAM_FRAMES - 1)
+#error NM_STREAM_FRAMES must be a power of 2
+#endif
+
+// streams are owned by the audio thread while STREAM_PLAY, then handed to the decoder thread with
+// STREAM_CLOSE, which is the only one allowed to move them back to STREAM_FREE -- so the decoder
+// can never be mid-write into a ring that was reopened for something else
+enum {
+	STREAM_FREE,
+	STREAM_OPEN,
+	STREAM_PLAY,
+	STREAM_CLOSE
+};
+
+typedef struct {
+	atomic_int state;
+	const sample_st *smp;
+	const void *owner; // the sampler reading it, for streams_release
+	atomic_uint write; // frames decoded into the ring
+	atomic_uint read;  // frames consumed from the ring
+	nm_sample_st ring[NM_STREAM_FRAMES];
+} stream_st;
+
+static stream_st streams[NM_STREAMS_MAX];
+static atomic_uint stream_starved_frames;
+static atomic_uint stream_starved_reads;
+static atomic_bool stream_quit;
+static bool stream_running = false;
+static pthread_t stream_thread;
+
+// audio thread: grab a stream for smp, which picks up after its head, returns -1 if none are free
+static int stream_open(const sample_st *smp, const void *owner){
+	for (int i = 0; i < NM_STREAMS_MAX; i++){
+		int expect = STREAM_FREE;
+		if (!atomic_compare_exchange_strong(&streams[i].state, &expect, STREAM_OPEN))
+			continue;
+		streams[i].smp = smp;
+		streams[i].owner = owner;
+		atomic_store_explicit(&streams[i].write, smp->head, memory_order_relaxed);
+		atomic_store_explicit(&streams[i].read, smp->head, memory_order_relaxed);
+		atomic_store_explicit(&streams[i].state, STREAM_PLAY, memory_order_release);
+		return i;
+	}
+	return -1;
+}
+
+// audio thread: copy the next `size` frames out of the stream, whatever wasn't decoded in time is
+// zero (and counted as starved) -- returns false once the stream has played to the end
+static bool stream_read(int i, nm_sample_st *out, int size){
+	stream_st *st = &streams[i];
+	unsigned read = atomic_load_explicit(&st->read, memory_order_relaxed);
+	unsigned write = atomic_load_explicit(&st->write, memory_order_acquire);
+	int left = st->smp->size - read;
+	int avail = write > read ? mini(write - read, size) : 0;
+	for (int j = 0; j < avail; j++)
+		out[j] = st->ring[(read + j) % NM_STREAM_FRAMES];
+	if (avail < size){
+		memset(&out[avail], 0, sizeof(nm_sample_st) * (size - avail));
+		int starved = mini(size, left) - avail;
+		if (starved > 0){
+			atomic_fetch_add_explicit(&stream_starved_frames, starved, memory_order_relaxed);
+			atomic_fetch_add_explicit(&stream_starved_reads, 1, memory_order_relaxed);
+		}
+	}
+	// starved frames are skipped rather than played late, so the stream stays in time
+	atomic_store_explicit(&st->read, read + mini(size, left), memory_order_release);
+	return size < left;
+}
+
+static void stream_close(int i){
+	atomic_store_explicit(&streams[i].state, STREAM_CLOSE, memory_order_release);
+}
+
+// audio thread: close the streams of samplers in [lo, hi), for voices that were stopped before their
+// sample finished
+static void streams_release(const void *lo, const void *hi){
+	for (int i = 0; i < NM_STREAMS_MAX; i++){
+		if (atomic_load_explicit(&streams[i].state, memory_order_relaxed) == STREAM_PLAY &&
+			(const char *)streams[i].owner >= (const char *)lo &&
+			(const char *)streams[i].owner < (const char *)hi)
+			stream_close(i);
+	}
+}
+
+static void stream_fill(stream_st *st){
+	static float pcm[960 * 2 * 6]; // a few 20ms opus frames
+	sample_st *smp = (sample_st *)st->smp;
+	unsigned write = atomic_load_explicit(&st->write, memory_order_relaxed);
+	for (;;){
+		unsigned read = atomic_load_explicit(&st->read, memory_order_acquire);
+		if (write < read) // the reader skipped ahead after starving
+			write = read;
+		int room = NM_STREAM_FRAMES - (write - read);
+		int left = smp->size - write;
+		if (room < 960 || left <= 0)
+			break;
+		if (smp->of_pos != write && op_pcm_seek(smp->of, write) != 0)
+			break;
+		smp->of_pos = write;
+		int got = op_read_float_stereo(smp->of, pcm, mini(mini(room, left), 960 * 6) * 2);
+		if (got <= 0)
+			break;
+		smp->of_pos += got;
+		for (int j = 0; j < got; j++){
+			st->ring[(write + j) % NM_STREAM_FRAMES] =
+				(nm_sample_st){ pcm[j * 2], pcm[j * 2 + 1] };
+		}
+		write += got;
+		atomic_store_explicit(&st->write, write, memory_order_release);
+	}
+}
+
+static void *stream_main(void *arg){
+	while (!atomic_load_explicit(&stream_quit, memory_order_relaxed)){
+		for (int i = 0; i < NM_STREAMS_MAX; i++){
+			int state = atomic_load_explicit(&streams[i].state, memory_order_acquire);
+			if (state == STREAM_PLAY)
+				stream_fill(&streams[i]);
+			else if (state == STREAM_CLOSE)
+				atomic_store_explicit(&streams[i].state, STREAM_FREE, memory_order_release);
+		}
+		// top off every block or so
+		nanosleep(&(struct timespec){ 0, 1000000000L / 48000 * NM_K }, NULL);
+	}
+	return NULL;
+}
+
+bool nm_stream_start(){
+	if (stream_running)
+		return true;
+	atomic_store(&stream_quit, false);
+	if (pthread_create(&stream_thread, NULL, stream_main, NULL) != 0)
+		return false;
+	stream_running = true;
+	return true;
+}
+
+void nm_stream_stop(){
+	if (!stream_running)
+		return;
+	atomic_store(&stream_quit, true);
+	pthread_join(stream_thread, NULL);
+	stream_running = false;
+}
+
+nm_stream_stats_st nm_stream_stats(){
+	int active = 0;
+	for (int i = 0; i < NM_STREAMS_MAX; i++){
+		if (atomic_load_explicit(&streams[i].state, memory_order_relaxed) == STREAM_PLAY)
+			active++;
+	}
+	return (nm_stream_stats_st){
+		.active = active,
+		.starved_frames = atomic_load_explicit(&stream_starved_frames, memory_order_relaxed),
+		.starved_reads = atomic_load_explicit(&stream_starved_reads, memory_order_relaxed)
+	};
+}
+#endif
+
+// reads a preloaded sample at one of the nm_samplespeed rates
+typedef struct {
+	const nm_sample_st *data;
+	uint32_t size;
+	uint64_t pos;  // 32.32 fixed point position in the sample
+	uint64_t step; // 32.32 fixed point sample frames per output frame
+	#ifdef NM_THREADS
+	const sample_st *smp; // set while streaming
+	int stream;
+	uint32_t base;        // frames read out of the head and the stream so far
+	nm_sample_st tail[4]; // the last four of them, which the cubic can still read
+	#endif
+} sampler_st;
+
+// returns false if there's nothing to play
+static bool sampler_start(sampler_st *sm, const sample_st *smp, nm_samplespeed speed){
+	int num = samplespeed_num[speed];
+	int den = samplespeed_den[speed];
+	sm->pos = 0;
+	sm->step = ((uint64_t)num << 32) / den;
+	#ifdef NM_THREADS
+	sm->smp = NULL;
+	if (smp->stream){
+		sm->stream = stream_open(smp, sm);
+		if (sm->stream < 0)
+			return false;
+		sm->smp = smp;
+		sm->data = &sample_arena[smp->offset];
+		sm->size = smp->size;
+		sm->base = 0;
+		memset(sm->tail, 0, sizeof(sm->tail));
+		return true;
+	}
+	#endif
+	if (num > 1){
+		sm->data = &sample_arena[smp->mip[num - 2]];
+		sm->size = sample_mipsize(smp->size, num);
+		sm->step = (uint64_t)1 << 32;
+	}
+	else{
+		sm->data = &sample_arena[smp->offset];
+		sm->size = smp->size;
+	}
+	return sm->size > 0;
+}
+
+static void sampler_stop(sampler_st *sm){
+	#ifdef NM_THREADS
+	if (sm->smp)
+		stream_close(sm->stream);
+	sm->smp = NULL;
+	#endif
+}
+
+static inline nm_sample_st sampler_at(const sampler_st *sm, int64_t i){
+	return i < 0 || i >= sm->size ? (nm_sample_st){ 0, 0 } : sm->data[i];
+}
+
+// add `size` frames of the table to outL/outR, returns false once it has played out
+static bool sampler_table(sampler_st *sm, float *outL, float *outR, int size, float volume,
+	float dvolume){
+	if (sm->step == ((uint64_t)1 << 32)){
+		// 1x, or a pre-decimated table
+		uint32_t i = sm->pos >> 32;
+		int n = i < sm->size ? mini(size, sm->size - i) : 0;
+		for (int j = 0; j < n; j++){
+			float g = volume + j * dvolume;
+			outL[j] += g * sm->data[i + j].L;
+			outR[j] += g * sm->data[i + j].R;
+		}
+		sm->pos += (uint64_t)size << 32;
+	}
+	else{
+		// 4-point Catmull-Rom between frames
+		for (int j = 0; j < size; j++){
+			int64_t i = sm->pos >> 32;
+			if (i >= sm->size)
+				break;
+			float t = (uint32_t)sm->pos * (1.0f / 4294967296.0f);
+			nm_sample_st p0 = sampler_at(sm, i - 1);
+			nm_sample_st p1 = sm->data[i];
+			nm_sample_st p2 = sampler_at(sm, i + 1);
+			nm_sample_st p3 = sampler_at(sm, i + 2);
+			#define CUBIC(c) (p1.c + 0.5f * t * (p2.c - p0.c + t * (2.0f * p0.c - 5.0f * p1.c + \
+				4.0f * p2.c - p3.c + t * (3.0f * (p1.c - p2.c) + p3.c - p0.c))))
+			outL[j] += volume * CUBIC(L);
+			outR[j] += volume * CUBIC(R);
+			#undef CUBIC
+			volume += dvolume;
+			sm->pos += sm->step;
+		}
+	}
+	return (sm->pos >> 32) < sm->size;
+}
+
+#ifdef NM_THREADS
+// a streamed block gathers the frames it reads into a window, after the tail of the last one, from
+// the head and then the stream, and plays the window as a table -- the block's first frame can sit
+// on the last block's last whole frame, so the cubic reaches back four
+static bool sampler_stream(sampler_st *sm, float *outL, float *outR, int size, float volume,
+	float dvolume){
+	nm_sample_st w[4 + NM_K * 4];
+	uint64_t last = sm->pos + sm->step * (size - 1);
+	int need = maxi(0, (int)((last >> 32) + 3 - sm->base));
+	memcpy(w, sm->tail, sizeof(sm->tail));
+	int n = 0;
+	if (sm->base < sm->smp->head){
+		n = mini(need, sm->smp->head - sm->base);
+		memcpy(&w[4], &sm->data[sm->base], sizeof(nm_sample_st) * n);
+	}
+	if (n < need)
+		stream_read(sm->stream, &w[4 + n], need - n);
+	sampler_st win = {
+		.data = w,
+		.size = mini(need + 4, sm->size + 4 - sm->base), // ends where the sample does
+		.pos = sm->pos - ((uint64_t)((int64_t)sm->base - 4) << 32),
+		.step = sm->step
+	};
+	sampler_table(&win, outL, outR, size, volume, dvolume);
+	memcpy(sm->tail, &w[need], sizeof(sm->tail));
+	sm->base += need;
+	sm->pos += sm->step * size;
+	return (sm->pos >> 32) < sm->size;
+}
+#endif
+
+// add `size` frames to outL/outR, returns false once the sample has played out
+static bool sampler_render(sampler_st *sm, float *outL, float *outR, int size, float volume,
+	float dvolume){
+	#ifdef NM_THREADS
+	if (sm->smp)
+		return sampler_stream(sm, outL, outR, size, volume, dvolume);
+	#endif
+	return sampler_table(sm, outL, outR, size, volume, dvolume);
 }
 
 //
 // VOICES
 //
 
-#ifndef NDEBUG
+// a voice's state has to fit the slots in nm_ctx_st, which is checked when it's registered
 #define VABOUT_SIZES()                                                 \
-		.vdata_size = sizeof(NAME(vst)),                               \
-		.cdata_size = sizeof(NAME(cst)),
-#else
-#define VABOUT_SIZES()
-#endif
+	_Static_assert(sizeof(NAME(vst)) <= NM_VDATA_SIZE,                 \
+		"voice state doesn't fit NM_VDATA_SIZE");                      \
+	_Static_assert(sizeof(NAME(cst)) <= NM_CDATA_SIZE,                 \
+		"clip state doesn't fit NM_CDATA_SIZE")
 
 #define VABOUT_POLY(id, vc, na, xl, xd, yl, yd)                        \
+	VABOUT_SIZES();                                                    \
 	static const vabout_st NAME(about) = {                             \
-		VABOUT_SIZES()                                                 \
+		.chord = NAME(chord),                                          \
 		.f_build = (build_f)NAME(poly_build),                          \
 		.f_render = (render_f)NAME(poly_render),                       \
 		.f.poly.f_noteon = (poly_noteon_f)NAME(poly_noteon),           \
@@ -443,8 +1143,8 @@ static inline bool envelope_done(envelope_st *env){
 	}
 
 #define VABOUT_MONO(id, vc, na, xl, xd, yl, yd)                        \
+	VABOUT_SIZES();                                                    \
 	static const vabout_st NAME(about) = {                             \
-		VABOUT_SIZES()                                                 \
 		.f_build = (build_f)NAME(mono_build),                          \
 		.f_render = (render_f)NAME(mono_render),                       \
 		.f.mono.f_noteon = (mono_noteon_f)NAME(mono_noteon),           \
@@ -461,9 +1161,10 @@ static inline bool envelope_done(envelope_st *env){
 		}                                                              \
 	}
 
-#define VABOUT_SAMPLE(id, vc, na, xl, xd, yl, yd)                      \
+// the trailing arguments name the voice's samples (up to 15), loaded from samples_path/name.opus
+#define VABOUT_SAMPLE(id, vc, na, xl, xd, yl, yd, ...)                 \
+	VABOUT_SIZES();                                                    \
 	static const vabout_st NAME(about) = {                             \
-		VABOUT_SIZES()                                                 \
 		.f_build = (build_f)NAME(sample_build),                        \
 		.f_render = (render_f)NAME(sample_render),                     \
 		.f.sample.f_noteon = (sample_noteon_f)NAME(sample_noteon),     \
@@ -474,89 +1175,1558 @@ static inline bool envelope_done(envelope_st *env){
 			.vcat = vc,                                                \
 			.name = na,                                                \
 			.xlabel = xl, .x = xd,                                     \
-			.ylabel = yl, .y = yd                                      \
+			.ylabel = yl, .y = yd,                                     \
+			.samples = { __VA_ARGS__ }                                 \
 		}                                                              \
 	}
 
 #include "voice/1001_square.c"
 #include "voice/1002_saw.c"
+#include "voice/1003_drums.c"
+
+// every voice, sorted by voice_id -- a voice is added by including its file above and listing its
+// id here, and everything below is generated from the list
+#define VOICES(X) \
+	X(1001)       \
+	X(1002)       \
+	X(1003)
 
 static const nm_voice_st end_voice = {0};
 
+#define X(id) &v ## id ## _about.voice,
 const nm_voice_st *nm_voices[] = {
-	&v1001_about.voice,
-	&v1002_about.voice,
+	VOICES(X)
 	&end_voice
 };
+#undef X
+
+#define X(id) &v ## id ## _about,
+static const vabout_st *vabouts[] = {
+	VOICES(X)
+};
+#undef X
+
+// unions are as big as their biggest member, which gives the largest voice and clip state, and the
+// range of voice ids, as constants
+#define X(id) v ## id ## _vst v ## id;
+typedef union { VOICES(X) } vdata_max_u;
+#undef X
+#define X(id) v ## id ## _cst v ## id;
+typedef union { VOICES(X) } cdata_max_u;
+#undef X
+#define X(id) char v ## id[id];
+typedef union { VOICES(X) } voice_id_max_u;
+#undef X
+#define VOICE_ID_MAX ((int)sizeof(voice_id_max_u))
+#define X(id) char v ## id[VOICE_ID_MAX + 1 - id];
+typedef union { VOICES(X) } voice_id_range_u;
+#undef X
+#define VOICE_ID_MIN (VOICE_ID_MAX + 1 - (int)sizeof(voice_id_range_u))
+
+// the slots in nm_ctx_st are the state sizes rounded up to a cache line, so the defaults should
+// match exactly -- update them in nightmare.h when this fails
+#define SLOT_SIZE(sz) (((sz) + 63) & ~(size_t)63)
+#ifdef NM_VDATA_DEFAULT
+_Static_assert(NM_VDATA_SIZE == SLOT_SIZE(sizeof(vdata_max_u)), "NM_VDATA_SIZE is out of date");
+#endif
+#ifdef NM_CDATA_DEFAULT
+_Static_assert(NM_CDATA_SIZE == SLOT_SIZE(sizeof(cdata_max_u)), "NM_CDATA_SIZE is out of date");
+#endif
+#undef SLOT_SIZE
+
+// indexed by voice_id, for resolving a clip's voice in constant time
+#define X(id) [id - VOICE_ID_MIN] = &v ## id ## _about,
+static const vabout_st *vabout_ids[VOICE_ID_MAX + 1 - VOICE_ID_MIN] = {
+	VOICES(X)
+};
+#undef X
+
+static const vabout_st *vabout_find(int voice_id){
+	if (voice_id < VOICE_ID_MIN || voice_id > VOICE_ID_MAX)
+		return NULL;
+	return vabout_ids[voice_id - VOICE_ID_MIN];
+}
+
+// index of the voice in vabouts (and nm_voices), for per-voice tables like the sample bank and stats
+static inline int vabout_index(const vabout_st *about){
+	int v = 0;
+	while (vabouts[v] != about)
+		v++;
+	return v;
+}
 
+#ifdef NM_STATS
 //
-// API
+// STATS
 //
 
-void nm_init(){
-	// TODO: load the opus samples into memory
+// timing uses the cpu's cycle counter where there is one, since it's read around every voice
+// render -- nm_init measures how long a tick is
+_Static_assert(sizeof(vabouts) / sizeof(vabouts[0]) <= NM_STATS_VOICES,
+	"NM_STATS_VOICES is smaller than the voice list");
 
-	#ifndef NDEBUG
-	// TODO: validate voices are sorted
-	// TODO: validate no voices surpass vdata's size
-	// TODO: validate no voices surpass cdata's size
+static double stats_tick_ns = 1;
+
+static inline uint64_t stats_ticks(){
+	#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+	#elif defined(__aarch64__)
+	uint64_t t;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+	return t;
+	#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 	#endif
 }
 
-void nm_clear(nm_ctx_st *nm){
-	memset(nm, 0, sizeof(nm_ctx_st));
-	nm->tempo = 30; // 120bpm
+static void stats_calibrate(){
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	uint64_t k0 = stats_ticks();
+	double ns;
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	} while (ns < 2e6);
+	uint64_t k1 = stats_ticks();
+	if (k1 > k0)
+		stats_tick_ns = ns / (k1 - k0);
 }
 
-static inline void renderblock(nm_ctx_st *nm, nm_sample_st *out){
-	// render a block to out (200 samples, NM_K)
-
-	// TODO: render to channels, volume, panning, reverb send
+static void stats_begin(nm_ctx_st *nm){
+	if (!atomic_exchange_explicit(&nm->stats.reset, false, memory_order_acquire))
+		return;
+	nm_stats_st *cur = &nm->stats.cur;
+	for (int v = 0; v < cur->voices_size; v++){
+		cur->voices[v].renders = 0;
+		cur->voices[v].ns = 0;
+	}
+	cur->blocks = cur->over_budget = cur->partial = cur->steals = 0;
+	cur->active_max = 0;
+	cur->block_ns_max = cur->block_ns_avg = 0;
+}
 
-	for (int i = 0; i < 64; i++){
-		if (!nm->avoices[i].aid)
-			continue;
-		vabout_st *about = (vabout_st *)nm->avoices[i].about;
-		if (!about->f_render(
-			out,
-			nm->avoices[i].vdata,
-			nm->clips[nm->avoices[i].clip_id].cdata,
-			0.5f, 0.0f, // TODO: these
-			0.5f, 0.0f,
-			0.5f, 0.0f
-		))
-			nm->avoices[i].aid = 0;
+// fold the lanes into the counters and publish them
+static void stats_end(nm_ctx_st *nm, uint64_t ticks){
+	nm_stats_st *cur = &nm->stats.cur;
+	for (int lane = 0; lane < NM_LANES; lane++){
+		for (int v = 0; v < cur->voices_size; v++){
+			cur->voices[v].renders += nm->stats.lanes[lane].renders[v];
+			cur->voices[v].ns += nm->stats.lanes[lane].ticks[v] * stats_tick_ns;
+		}
 	}
+	memset(nm->stats.lanes, 0, sizeof(nm->stats.lanes));
+
+	double ns = ticks * stats_tick_ns;
+	cur->blocks++;
+	cur->block_ns = ns;
+	if (ns > cur->block_ns_max)
+		cur->block_ns_max = ns;
+	cur->block_ns_avg += (ns - cur->block_ns_avg) / cur->blocks;
+	if (ns > atomic_load_explicit(&nm->stats.budget_ns, memory_order_relaxed))
+		cur->over_budget++;
+
+	// sequence lock: readers retry if seq was odd or changed while they copied
+	unsigned seq = atomic_load_explicit(&nm->stats.seq, memory_order_relaxed);
+	atomic_store_explicit(&nm->stats.seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	nm->stats.pub = *cur;
+	atomic_store_explicit(&nm->stats.seq, seq + 2, memory_order_release);
 }
+#endif
 
-void nm_render(nm_ctx_st *nm, nm_sample_st *out, size_t outsize){
-	// the engine renders in blocks of size 200 samples (NM_K)
-	// therefore, we need to buffer the last block to account for misaligned renders
+//
+// SAMPLE BANK
+//
 
-	// check for a buffered block, which should be output first before rendering more
-	int s = nm->kbuf_size;
-	if (nm->kbuf_size > 0){
-		// we can't just memcpy because we need to add to out
-		for (int i = 0; i < nm->kbuf_size; i++){
-			out[i].L += nm->kbuf[i].L;
-			out[i].R += nm->kbuf[i].R;
+#define VOICES_SIZE (sizeof(nm_voices) / sizeof(nm_voices[0]) - 1)
+
+// each sample voice's samples, by its index in vabouts
+static sample_st sample_bank[VOICES_SIZE][15];
+
+// load every sample that isn't loaded yet -- one that fails is left empty (so its notes play
+// nothing) and gets another try on the next call
+static bool samples_load(const char *samples_path){
+	char path[1024];
+	bool ok = true;
+	for (size_t v = 0; v < VOICES_SIZE; v++){
+		if (nm_voices[v]->vtype != NM_VT_SAMPLE)
+			continue;
+		for (int i = 0; i < 15 && nm_voices[v]->samples[i]; i++){
+			sample_st *smp = &sample_bank[v][i];
+			if (smp->loaded)
+				continue;
+			snprintf(path, sizeof(path), "%s/%s.opus", samples_path, nm_voices[v]->samples[i]);
+			if (sample_load(smp, path))
+				smp->loaded = true;
+			else{
+				sample_unload(smp);
+				ok = false;
+			}
 		}
-		nm->kbuf_size = 0;
 	}
+	return ok;
+}
 
-	// render out!
-	size_t bcount = (outsize - s) / NM_K;
-	for (size_t b = 0; b < bcount; b++, s += NM_K)
-		renderblock(nm, &out[s]);
-
-	// check if we need a partial block, and if so, render a full block to the kbuf
-	int tail = outsize - s;
-	if (tail > 0){
-		nm->kbuf_size = NM_K - tail;
-		memcpy(nm->kbuf, &out[s], sizeof(nm_sample_st) * tail);
-		memset(&nm->kbuf[tail], 0, sizeof(nm_sample_st) * nm->kbuf_size);
-		renderblock(nm, nm->kbuf);
-		memcpy(&out[s], nm->kbuf, sizeof(nm_sample_st) * tail);
-		memmove(nm->kbuf, &nm->kbuf[tail], sizeof(nm_sample_st) * nm->kbuf_size);
+int nm_samples_missing(int voice_id){
+	const vabout_st *about = vabout_find(voice_id);
+	if (about == NULL || about->voice.vtype != NM_VT_SAMPLE)
+		return 0;
+	const sample_st *bank = sample_bank[vabout_index(about)];
+	int missing = 0;
+	for (int i = 0; i < 15 && about->voice.samples[i]; i++){
+		if (!bank[i].loaded)
+			missing++;
 	}
+	return missing;
+}
+
+size_t nm_samples_bytes(int voice_id){
+	const vabout_st *about = vabout_find(voice_id);
+	if (about == NULL)
+		return 0;
+	const sample_st *bank = sample_bank[vabout_index(about)];
+	size_t frames = 0;
+	for (int i = 0; i < 15; i++)
+		frames += bank[i].frames; // just the head, for a streamed sample
+	return frames * sizeof(nm_sample_st);
+}
+
+size_t nm_samples_used(){
+	return sample_arena_size * sizeof(nm_sample_st);
+}
+
+size_t nm_samples_capacity(){
+	return sizeof(sample_arena);
 }
+
+//
+// AVOICES
+//
+
+// live avoices are tracked in nm->active, a dense list of slots kept grouped by voice, so the
+// renderer never scans dead slots and runs the same render function back to back
+
+static void avoice_release(nm_ctx_st *nm, int index){
+	int slot = nm->active[index];
+	nm->avoices[slot].aid = 0;
+	#ifdef NM_THREADS
+	streams_release(nm->vdata[slot], nm->vdata[slot] + NM_VDATA_SIZE);
+	#endif
+	nm->avfree[nm->avfree_size++] = slot;
+	nm->active_size--;
+	memmove(&nm->active[index], &nm->active[index + 1], sizeof(int) * (nm->active_size - index));
+}
+
+// allocate an avoice for clip_id, stealing the lowest priority (then oldest) voice if the pool is
+// full -- returns the slot, or -1 if every live voice has a higher priority
+static int avoice_alloc(nm_ctx_st *nm, const vabout_st *about, int clip_id, int priority){
+	if (nm->avfree_size <= 0){
+		int steal = -1;
+		for (int i = 0; i < nm->active_size; i++){
+			int slot = nm->active[i];
+			if (nm->avoices[slot].priority > priority)
+				continue;
+			if (steal < 0 ||
+				nm->avoices[slot].priority < nm->avoices[nm->active[steal]].priority ||
+				(nm->avoices[slot].priority == nm->avoices[nm->active[steal]].priority &&
+				nm->avoices[slot].aid < nm->avoices[nm->active[steal]].aid))
+				steal = i;
+		}
+		if (steal < 0)
+			return -1;
+		avoice_release(nm, steal);
+		#ifdef NM_STATS
+		nm->stats.cur.steals++;
+		#endif
+	}
+	int slot = nm->avfree[--nm->avfree_size];
+
+	// insert after the last voice with the same about, or at the end
+	int index = nm->active_size;
+	for (int i = nm->active_size - 1; i >= 0; i--){
+		if (nm->avoices[nm->active[i]].about == about){
+			index = i + 1;
+			break;
+		}
+	}
+	memmove(&nm->active[index + 1], &nm->active[index], sizeof(int) * (nm->active_size - index));
+	nm->active[index] = slot;
+	nm->active_size++;
+
+	memset(&nm->avoices[slot], 0, sizeof(nm->avoices[slot]));
+	memset(&nm->avnotes[slot], 0, sizeof(nm->avnotes[slot]));
+	memset(nm->vdata[slot], 0, sizeof(nm->vdata[slot]));
+	nm->aid_next = nm->aid_next >= 0x7FFFFFFF ? 1 : nm->aid_next + 1;
+	nm->avoices[slot].aid = nm->aid_next;
+	nm->avoices[slot].priority = priority;
+	nm->avoices[slot].clip_id = clip_id;
+	nm->avoices[slot].about = (void *)about;
+	nm->avoices[slot].x = nm->clips[clip_id].x / 100.0f;
+	nm->avoices[slot].y = nm->clips[clip_id].y / 100.0f;
+	return slot;
+}
+
+//
+// SONG
+//
+
+// every 1/16th note lasts a whole number of k-blocks (nm->tempo), so the notes of a step all land
+// on the first sample of a block
+// each clip keeps its notes sorted by start in clip.order, with a cursor to the next one, so a step
+// only looks at the notes that actually start, and seeking is a binary search per clip
+// sequenced notes get their own avoice, which remembers the step to release it on
+
+#define SONG_STEPS      (NM_BARS_MAX * 16)
+#define SONG_PRIORITY   1
+
+static const int oscscale_major[] = { 0, 2, 4, 5, 7, 9, 11 };
+static const int oscscale_minor[] = { 0, 2, 3, 5, 7, 8, 10 };
+static const int oscscale_majorpent[] = { 0, 2, 4, 7, 9 };
+static const int oscscale_minorpent[] = { 0, 3, 5, 7, 10 };
+
+// convert a note's y1 to a midi note
+static int oscscale_note(nm_oscscale oscscale, int y){
+	#define SCALE(base, tbl)  \
+		(base + 12 * (y / (int)(sizeof(tbl) / sizeof(tbl[0]))) + \
+		tbl[y % (int)(sizeof(tbl) / sizeof(tbl[0]))])
+	y = maxi(0, y);
+	switch (oscscale){
+		case NM_OS_CHROMATICLOW:     return 28 + y; // E1
+		case NM_OS_CHROMATICMID:     return 52 + y; // E3
+		case NM_OS_CHROMATICHIGH:    return 76 + y; // E5
+		case NM_OS_EMAJOR:           return SCALE(40, oscscale_major);
+		case NM_OS_EMINOR:           return SCALE(40, oscscale_minor);
+		case NM_OS_EMAJORPENTATONIC: return SCALE(40, oscscale_majorpent);
+		case NM_OS_EMINORPENTATONIC: return SCALE(40, oscscale_minorpent);
+	}
+	#undef SCALE
+	return 52 + y;
+}
+
+// a clip's note number -- sample voices use it to pick the sample, the rest map it through the
+// clip's oscscale
+static inline int clip_note(nm_ctx_st *nm, int clip_id, int y){
+	const vabout_st *about = nm->clips[clip_id].about;
+	if (about->voice.vtype == NM_VT_SAMPLE)
+		return y;
+	return oscscale_note(nm->clips[clip_id].u.oscscale, y);
+}
+
+static inline float note_freq(int note){
+	return 440.0f * powf(2.0f, (note - 69) / 12.0f);
+}
+
+// index into clip.order of the first note starting on or after step
+static int song_lowerbound(nm_ctx_st *nm, int clip_id, int step){
+	const int *order = nm->clips[clip_id].order;
+	const nm_note_st *notes = nm->clips[clip_id].notes;
+	int lo = 0;
+	int hi = nm->clips[clip_id].notes_size;
+	while (lo < hi){
+		int mid = (lo + hi) / 2;
+		if (notes[order[mid]].x1 < step)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// first step the sequencer hasn't started notes for
+static inline int song_pending(nm_ctx_st *nm){
+	return nm->song.tick == 0 ? nm->song.step : nm->song.step + 1;
+}
+
+// start a poly voice's note -- voices that play chords add it to the clip's newest avoice if it has
+// room, otherwise the note gets an avoice of its own -- returns the slot, or -1
+static int avoice_poly(nm_ctx_st *nm, const vabout_st *about, int clip_id, int priority, int note,
+	float velocity){
+	int slot = -1;
+	if (about->chord > 1){
+		for (int i = 0; i < nm->active_size; i++){
+			int s = nm->active[i];
+			if (nm->avoices[s].aid && nm->avoices[s].about == about &&
+				nm->avoices[s].clip_id == clip_id &&
+				(slot < 0 || nm->avoices[s].aid > nm->avoices[slot].aid))
+				slot = s;
+		}
+	}
+	if (slot >= 0 && about->f.poly.f_noteon(nm->vdata[slot], nm->cdata[clip_id], note,
+		nm->avnotes[slot].ids, note_freq(note), velocity, nm->avoices[slot].x,
+		nm->avoices[slot].y))
+		nm->avoices[slot].priority = maxi(nm->avoices[slot].priority, priority);
+	else{
+		slot = avoice_alloc(nm, about, clip_id, priority);
+		if (slot < 0)
+			return -1;
+		about->f.poly.f_noteon(nm->vdata[slot], nm->cdata[clip_id], note, 0, note_freq(note),
+			velocity, nm->avoices[slot].x, nm->avoices[slot].y);
+	}
+	return slot;
+}
+
+// start a sample voice's note, where the note picks the sample -- every note gets an avoice of its
+// own -- returns the slot, or -1
+static int avoice_sample(nm_ctx_st *nm, const vabout_st *about, int clip_id, int priority,
+	int note, float velocity){
+	int slot = avoice_alloc(nm, about, clip_id, priority);
+	if (slot < 0)
+		return -1;
+	const sample_st *smp = &sample_bank[vabout_index(about)][clampi(note, 0, 14)];
+	if (!about->f.sample.f_noteon(nm->vdata[slot], nm->cdata[clip_id], smp,
+		nm->clips[clip_id].u.samplespeed, velocity, nm->avoices[slot].x, nm->avoices[slot].y)){
+		nm->avoices[slot].aid = 0; // collected with the finished voices at the end of the block
+		return -1;
+	}
+	return slot;
+}
+
+// start a note on the clip, remembering it on the avoice so it can be released
+static void avoice_noteon(nm_ctx_st *nm, int clip_id, int priority, int note, float velocity,
+	int end, bool held){
+	const vabout_st *about = nm->clips[clip_id].about;
+	int slot = about->voice.vtype == NM_VT_SAMPLE ?
+		avoice_sample(nm, about, clip_id, priority, note, velocity) :
+		avoice_poly(nm, about, clip_id, priority, note, velocity);
+	if (slot < 0)
+		return;
+	int k = nm->avnotes[slot].notes++;
+	nm->avnotes[slot].note[k] = note;
+	nm->avnotes[slot].id[k] = nm->avnotes[slot].ids++;
+	nm->avnotes[slot].end[k] = end;
+	nm->avnotes[slot].held[k] = held;
+}
+
+// release the avoice's kth note, which drops it from the avoice's notes
+static void avoice_noteoff(nm_ctx_st *nm, int slot, int k){
+	const vabout_st *about = nm->avoices[slot].about;
+	int note = nm->avnotes[slot].note[k];
+	int id = nm->avnotes[slot].id[k];
+	int move = --nm->avnotes[slot].notes - k;
+	memmove(&nm->avnotes[slot].note[k], &nm->avnotes[slot].note[k + 1], sizeof(int16_t) * move);
+	memmove(&nm->avnotes[slot].id[k], &nm->avnotes[slot].id[k + 1], sizeof(int) * move);
+	memmove(&nm->avnotes[slot].end[k], &nm->avnotes[slot].end[k + 1], sizeof(int16_t) * move);
+	memmove(&nm->avnotes[slot].held[k], &nm->avnotes[slot].held[k + 1], sizeof(bool) * move);
+	if (about->voice.vtype == NM_VT_SAMPLE){
+		about->f.sample.f_noteoff(nm->vdata[slot], nm->cdata[nm->avoices[slot].clip_id]);
+		return;
+	}
+	about->f.poly.f_noteoff(
+		nm->vdata[slot],
+		nm->cdata[nm->avoices[slot].clip_id],
+		note,
+		id,
+		note_freq(note)
+	);
+}
+
+static void song_noteon(nm_ctx_st *nm, int clip_id, const nm_note_st *n){
+	const vabout_st *about = nm->clips[clip_id].about;
+	if (about == NULL || n->x2 <= n->x1)
+		return;
+	if (about->voice.vtype == NM_VT_MONO)
+		return; // TODO: mono voices
+	int note = clip_note(nm, clip_id, n->y1);
+	avoice_noteon(nm, clip_id, SONG_PRIORITY, note, n->velocity / 100.0f, n->x2, false);
+}
+
+// release the sequenced notes ending by step (or all of them, for step -1)
+static void song_noteoffs(nm_ctx_st *nm, int step){
+	for (int i = 0; i < nm->active_size; i++){
+		int slot = nm->active[i];
+		for (int k = nm->avnotes[slot].notes - 1; k >= 0; k--){
+			int end = nm->avnotes[slot].end[k];
+			if (end >= 0 && (step < 0 || end <= step))
+				avoice_noteoff(nm, slot, k);
+		}
+	}
+}
+
+static void song_releaseall(nm_ctx_st *nm){
+	song_noteoffs(nm, -1);
+}
+
+// advance the song by a block, starting and stopping the notes of each new step
+static void song_block(nm_ctx_st *nm){
+	if (!nm->song.playing)
+		return;
+	if (nm->song.tick == 0){
+		int step = nm->song.step;
+		if (step >= SONG_STEPS){
+			nm_song_stop(nm);
+			return;
+		}
+
+		// releases go first, so a note ending where the next one starts frees its voice
+		song_noteoffs(nm, step);
+
+		for (int c = 0; c < NM_CLIP_MAX; c++){
+			int *next = &nm->clips[c].next;
+			const int *order = nm->clips[c].order;
+			const nm_note_st *notes = nm->clips[c].notes;
+			while (*next < nm->clips[c].notes_size && notes[order[*next]].x1 <= step){
+				song_noteon(nm, c, &notes[order[*next]]);
+				(*next)++;
+			}
+		}
+	}
+	if (++nm->song.tick >= nm->tempo){
+		nm->song.tick = 0;
+		nm->song.step++;
+	}
+}
+
+//
+// EVENTS
+//
+
+// live events go through a bounded lock-free queue (Vyukov's), so any number of game threads can
+// push while the audio thread renders -- the audio thread moves them into a pending list sorted by
+// time, and renderblock splits the block at each event's sample so it lands exactly
+
+enum {
+	EVENT_NOTEON,
+	EVENT_NOTEOFF
+};
+
+#define EVENT_PRIORITY 2 // live notes outrank the song
+
+static void events_reset(nm_ctx_st *nm){
+	for (unsigned i = 0; i < NM_EVENTS_MAX; i++)
+		atomic_store_explicit(&nm->events.ring[i].seq, i, memory_order_relaxed);
+	atomic_store_explicit(&nm->events.head, 0, memory_order_relaxed);
+	nm->events.tail = 0;
+	nm->events.pending_size = 0;
+}
+
+static bool events_push(nm_ctx_st *nm, nm_event_st ev){
+	if (ev.time > nm_time(nm) + NM_EVENTS_HORIZON){
+		atomic_fetch_add_explicit(&nm->events.toofar, 1, memory_order_relaxed);
+		return false;
+	}
+	unsigned pos = atomic_load_explicit(&nm->events.head, memory_order_relaxed);
+	for (;;){
+		unsigned seq = atomic_load_explicit(&nm->events.ring[pos & (NM_EVENTS_MAX - 1)].seq,
+			memory_order_acquire);
+		int dif = (int)(seq - pos);
+		if (dif == 0){
+			if (atomic_compare_exchange_weak_explicit(&nm->events.head, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0){
+			atomic_fetch_add_explicit(&nm->events.dropped, 1, memory_order_relaxed);
+			return false;
+		}
+		else
+			pos = atomic_load_explicit(&nm->events.head, memory_order_relaxed);
+	}
+	nm->events.ring[pos & (NM_EVENTS_MAX - 1)].ev = ev;
+	atomic_store_explicit(&nm->events.ring[pos & (NM_EVENTS_MAX - 1)].seq, pos + 1,
+		memory_order_release);
+	return true;
+}
+
+// move pushed events into the pending list, as many as fit
+static void events_drain(nm_ctx_st *nm){
+	while (nm->events.pending_size < NM_EVENTS_MAX){
+		unsigned tail = nm->events.tail;
+		unsigned seq = atomic_load_explicit(&nm->events.ring[tail & (NM_EVENTS_MAX - 1)].seq,
+			memory_order_acquire);
+		if ((int)(seq - (tail + 1)) < 0)
+			break;
+		nm_event_st ev = nm->events.ring[tail & (NM_EVENTS_MAX - 1)].ev;
+		atomic_store_explicit(&nm->events.ring[tail & (NM_EVENTS_MAX - 1)].seq,
+			tail + NM_EVENTS_MAX, memory_order_release);
+		nm->events.tail = tail + 1;
+
+		// insert after pending events with the same time, so pushes keep their order
+		int i = nm->events.pending_size;
+		while (i > 0 && nm->events.pending[i - 1].time > ev.time){
+			nm->events.pending[i] = nm->events.pending[i - 1];
+			i--;
+		}
+		nm->events.pending[i] = ev;
+		nm->events.pending_size++;
+	}
+	unsigned size = nm->events.pending_size;
+	if (size > atomic_load_explicit(&nm->events.highwater, memory_order_relaxed))
+		atomic_store_explicit(&nm->events.highwater, size, memory_order_relaxed);
+}
+
+static void event_apply(nm_ctx_st *nm, const nm_event_st *ev){
+	if (ev->clip_id < 0 || ev->clip_id >= NM_CLIP_MAX)
+		return;
+	const vabout_st *about = nm->clips[ev->clip_id].about;
+	if (about == NULL || about->voice.vtype == NM_VT_MONO)
+		return; // TODO: mono voices
+	int note = clip_note(nm, ev->clip_id, ev->note);
+	if (ev->type == EVENT_NOTEON)
+		avoice_noteon(nm, ev->clip_id, EVENT_PRIORITY, note, ev->velocity / 100.0f, -1, true);
+	else{
+		// release the oldest live voice playing the note
+		int best = -1;
+		int bestk = 0;
+		for (int i = 0; i < nm->active_size; i++){
+			int slot = nm->active[i];
+			if (nm->avoices[slot].aid == 0 || nm->avoices[slot].clip_id != ev->clip_id ||
+				(best >= 0 && nm->avoices[slot].aid > nm->avoices[best].aid))
+				continue;
+			for (int k = 0; k < nm->avnotes[slot].notes; k++){
+				if (nm->avnotes[slot].held[k] && nm->avnotes[slot].note[k] == note){
+					best = slot;
+					bestk = k;
+					break;
+				}
+			}
+		}
+		if (best >= 0)
+			avoice_noteoff(nm, best, bestk);
+	}
+}
+
+//
+// CHANNELS
+//
+
+// every voice renders into the strip picked by its clip's out -- strips ramp from their last gains
+// to the current targets over each block, so parameter changes don't zipper, and the cost is a
+// fixed pass per used strip no matter how many voices feed it
+
+// strip volume is applied by the voices themselves, through their volume/dvolume arguments
+static void channels_begin(nm_ctx_st *nm){
+	for (int ch = 0; ch < NM_CHANNELS_MAX; ch++){
+		nm->channels[ch].dvol =
+			(nm->channels[ch].volume / 100.0f - nm->channels[ch].vol) / NM_K;
+	}
+}
+
+// sum each strip's lanes in lane order, then pan it into out and feed the reverb send bus --
+// returns true if anything was sent
+static bool channels_mix(nm_ctx_st *nm, nm_block_st *out){
+	bool sending = false;
+	memset(&nm->send, 0, sizeof(nm->send));
+	for (int ch = 0; ch < NM_CHANNELS_MAX; ch++){
+		nm_block_st *acc = NULL;
+		for (int lane = 0; lane < NM_LANES; lane++){
+			if (!nm->lanes_used[lane][ch])
+				continue;
+			nm_block_st *buf = &nm->lanes[lane][ch];
+			if (acc == NULL)
+				acc = buf;
+			else{
+				for (int i = 0; i < NM_K; i++){
+					acc->L[i] += buf->L[i];
+					acc->R[i] += buf->R[i];
+				}
+			}
+		}
+
+		// pan is a balance, so the center passes both sides at unity
+		float pan = nm->channels[ch].pan / 100.0f;
+		float gl = minf(1, 1 - pan);
+		float gr = minf(1, 1 + pan);
+		float send = nm->channels[ch].reverb / 100.0f;
+		if (acc){
+			float l = nm->channels[ch].gl;
+			float r = nm->channels[ch].gr;
+			float dl = (gl - l) / NM_K;
+			float dr = (gr - r) / NM_K;
+			for (int i = 0; i < NM_K; i++){
+				acc->L[i] *= l + i * dl;
+				acc->R[i] *= r + i * dr;
+				out->L[i] += acc->L[i];
+				out->R[i] += acc->R[i];
+			}
+			float sn = nm->channels[ch].send;
+			if (sn > 0 || send > 0){
+				float dsn = (send - sn) / NM_K;
+				for (int i = 0; i < NM_K; i++){
+					float g = sn + i * dsn;
+					nm->send.L[i] += acc->L[i] * g;
+					nm->send.R[i] += acc->R[i] * g;
+				}
+				sending = true;
+			}
+		}
+		nm->channels[ch].vol = nm->channels[ch].volume / 100.0f;
+		nm->channels[ch].gl = gl;
+		nm->channels[ch].gr = gr;
+		nm->channels[ch].send = send;
+	}
+	return sending;
+}
+
+//
+// REVERB
+//
+
+// feedback delay network: 8 delay lines (4 in low quality) mixed through a Householder matrix, with
+// a lowpass and a decay gain in each feedback path
+// every delay is longer than NM_K, so a whole block is read out of the lines before any of it is
+// written back, and the per-sample work runs across the lines, so it vectorizes -- Householder
+// mixing is just a sum and a subtract, where Hadamard would need shuffles
+
+#define REVERB_T60   1.8f  // seconds to decay by 60dB
+#define REVERB_DAMP  0.35f // lowpass coefficient in the feedback paths, higher is brighter
+#define REVERB_TAIL  ((int)(REVERB_T60 * 2 * 48000 / NM_K)) // blocks to decay by 120dB
+#define REVERB_QUIET ((2833 + NM_K - 1) / NM_K) // blocks to read out the longest line
+
+static const int reverb_delay[8] = { 1433, 1601, 1867, 2053, 2251, 2399, 2617, 2833 };
+static float reverb_gain[8];
+
+// how much of the send's left and right goes into each line, flipping polarity every other pair
+static const float reverb_inl[8] = { 1, 0, -1, 0, 1, 0, -1, 0 };
+static const float reverb_inr[8] = { 0, 1, 0, -1, 0, 1, 0, -1 };
+
+static void reverb_init(){
+	for (int j = 0; j < 8; j++)
+		reverb_gain[j] = powf(10.0f, -3.0f * reverb_delay[j] / (REVERB_T60 * 48000.0f));
+}
+
+// N is a constant at each call site, so the line loops unroll into straight vector code -- returns
+// the peak of what was added to out
+static inline __attribute__((always_inline)) float reverb_run(nm_ctx_st *nm, nm_block_st *out,
+	const int N){
+	const int mask = NM_REVERB_SIZE - 1;
+	const float house = 2.0f / N;
+	const float wet = N == 8 ? 0.5f : 0.70710678f; // 1 / sqrt(N / 2) per output side
+	int pos = nm->reverb.pos;
+
+	// read the block out of the lines, transposed so the lines sit side by side -- in at most two
+	// runs, split where the ring wraps
+	float x[NM_K][8];
+	for (int j = 0; j < N; j++){
+		const float *line = nm->reverb.lines[j];
+		int r = (pos - reverb_delay[j]) & mask;
+		int run = mini(NM_K, NM_REVERB_SIZE - r);
+		for (int i = 0; i < run; i++)
+			x[i][j] = line[r + i];
+		for (int i = run; i < NM_K; i++)
+			x[i][j] = line[i - run];
+	}
+
+	float damp[8];
+	for (int j = 0; j < N; j++)
+		damp[j] = nm->reverb.damp[j];
+	float peak = 0;
+	for (int i = 0; i < NM_K; i++){
+		float *v = x[i];
+
+		// even lines tap left, odd lines tap right
+		float l = 0;
+		float r = 0;
+		for (int j = 0; j < N; j += 2){
+			l += v[j];
+			r += v[j + 1];
+		}
+		out->L[i] += l * wet;
+		out->R[i] += r * wet;
+		peak = maxf(peak, maxf(absf(l), absf(r)));
+
+		float y[8];
+		float sum = 0;
+		for (int j = 0; j < N; j++){
+			damp[j] += REVERB_DAMP * (v[j] - damp[j]);
+			y[j] = damp[j] * reverb_gain[j];
+			sum += y[j];
+		}
+		sum *= house;
+		const float inl = nm->send.L[i];
+		const float inr = nm->send.R[i];
+		for (int j = 0; j < N; j++)
+			v[j] = y[j] - sum + inl * reverb_inl[j] + inr * reverb_inr[j];
+	}
+	for (int j = 0; j < N; j++)
+		nm->reverb.damp[j] = damp[j];
+
+	for (int j = 0; j < N; j++){
+		float *line = nm->reverb.lines[j];
+		int run = mini(NM_K, NM_REVERB_SIZE - pos);
+		for (int i = 0; i < run; i++)
+			line[pos + i] = x[i][j];
+		for (int i = run; i < NM_K; i++)
+			line[i - run] = x[i][j];
+	}
+	nm->reverb.pos = (pos + NM_K) & mask;
+	return peak * wet;
+}
+
+// only runs while something is being sent, or the tail is still ringing -- the tail ends when it's
+// decayed by 120dB, or sooner if the output has been below NM_SILENCE for as long as it takes to
+// read out every line, which means there's nothing left in them worth hearing
+static void reverb_block(nm_ctx_st *nm, nm_block_st *out, bool sending){
+	if (sending)
+		nm->reverb.tail = REVERB_TAIL;
+	else if (nm->reverb.tail <= 0)
+		return;
+	else if (--nm->reverb.tail <= 0 || nm->reverb.quiet >= REVERB_QUIET){
+		// clear what's left instead of letting it run into denormals
+		memset(nm->reverb.lines, 0, sizeof(nm->reverb.lines));
+		memset(nm->reverb.damp, 0, sizeof(nm->reverb.damp));
+		nm->reverb.tail = 0;
+		nm->reverb.quiet = 0;
+		return;
+	}
+	float peak = nm->reverb.low ? reverb_run(nm, out, 4) : reverb_run(nm, out, 8);
+	nm->reverb.quiet = peak < NM_SILENCE ? nm->reverb.quiet + 1 : 0;
+}
+
+//
+// GOVERNOR
+//
+
+// a tier is dropped when the smoothed load goes over GOVERNOR_HIGH, at most every GOVERNOR_WAIT
+// blocks so the load can settle at the new tier first, and raised after GOVERNOR_CALM blocks in a
+// row under GOVERNOR_LOW -- the gap between them keeps it from flapping between two tiers
+#define GOVERNOR_HIGH   0.9f
+#define GOVERNOR_LOW    0.6f
+#define GOVERNOR_WAIT   16
+#define GOVERNOR_CALM   240 // 1 second
+
+static inline double governor_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// steal the lowest priority (then oldest) avoice, leaving at least one playing
+static void governor_steal(nm_ctx_st *nm){
+	if (nm->active_size <= 1)
+		return;
+	int steal = 0;
+	for (int i = 1; i < nm->active_size; i++){
+		int slot = nm->active[i];
+		int best = nm->active[steal];
+		if (nm->avoices[slot].priority < nm->avoices[best].priority ||
+			(nm->avoices[slot].priority == nm->avoices[best].priority &&
+			nm->avoices[slot].aid < nm->avoices[best].aid))
+			steal = i;
+	}
+	avoice_release(nm, steal);
+	#ifdef NM_STATS
+	nm->stats.cur.steals++;
+	#endif
+}
+
+// update the quality after a block that took secs to render
+static void governor_block(nm_ctx_st *nm, double secs){
+	float load = secs * (48000.0 / NM_K) / nm->governor.budget;
+	nm->governor.load += (load - nm->governor.load) * 0.25f;
+	nm->governor.wait++;
+	if (nm->governor.load > GOVERNOR_HIGH){
+		nm->governor.calm = 0;
+		if (nm->governor.quality == NM_Q_STEAL)
+			governor_steal(nm);
+		else if (nm->governor.wait >= GOVERNOR_WAIT){
+			nm->governor.quality++;
+			nm->governor.wait = 0;
+		}
+	}
+	else if (nm->governor.load < GOVERNOR_LOW){
+		if (++nm->governor.calm >= GOVERNOR_CALM && nm->governor.quality > NM_Q_FULL){
+			nm->governor.quality--;
+			nm->governor.wait = 0;
+			nm->governor.calm = 0;
+		}
+	}
+	else
+		nm->governor.calm = 0;
+}
+
+//
+// API
+//
+
+bool nm_init(const char *samples_path){
+	bool ok = true;
+	if (samples_path)
+		ok = samples_load(samples_path);
+	reverb_init();
+	#ifdef NM_STATS
+	stats_calibrate();
+	#endif
+
+	#ifndef NDEBUG
+	// the voice list has to be sorted, and every id has to be the one its voice was registered with
+	for (size_t v = 0; v < VOICES_SIZE; v++){
+		int id = nm_voices[v]->voice_id;
+		if ((v > 0 && id <= nm_voices[v - 1]->voice_id) || vabout_find(id) != vabouts[v])
+			return false;
+	}
+	#endif
+	return ok;
+}
+
+void nm_clear(nm_ctx_st *nm){
+	#ifdef NM_THREADS
+	streams_release(nm, nm + 1);
+	#endif
+	memset(nm, 0, sizeof(nm_ctx_st));
+	nm->tempo = 30; // 120bpm
+	for (int i = 0; i < NM_AVOICES_MAX; i++)
+		nm->avfree[i] = NM_AVOICES_MAX - 1 - i;
+	nm->avfree_size = NM_AVOICES_MAX;
+	events_reset(nm);
+	for (int ch = 0; ch < NM_CHANNELS_MAX; ch++){
+		// half volume leaves headroom for several strips playing at once
+		nm->channels[ch].volume = 50;
+		nm->channels[ch].vol = 0.5f;
+		nm->channels[ch].gl = 1;
+		nm->channels[ch].gr = 1;
+	}
+	#ifdef NM_STATS
+	nm_stats_setbudget(nm, 1);
+	nm->stats.cur.voices_size = VOICES_SIZE;
+	for (size_t v = 0; v < VOICES_SIZE; v++)
+		nm->stats.cur.voices[v].voice_id = vabouts[v]->voice.voice_id;
+	nm->stats.pub = nm->stats.cur;
+	#endif
+}
+
+// render the lane's share of the active voices into its own strip buffers for the current part of
+// the block, flagging voices that finished by zeroing their aid -- each lane only touches its own
+// voices, so lanes can run in parallel
+static void renderlane(nm_ctx_st *nm, int lane){
+	int start = nm->active_size * lane / NM_LANES;
+	int end = nm->active_size * (lane + 1) / NM_LANES;
+	int off = nm->render_off;
+	int size = nm->render_size;
+	#ifdef NM_STATS
+	const vabout_st *stats_about = NULL;
+	int stats_v = 0;
+	#endif
+	for (int i = start; i < end; i++){
+		int slot = nm->active[i];
+		if (nm->avoices[slot].aid == 0)
+			continue; // finished earlier in the block
+		vabout_st *about = (vabout_st *)nm->avoices[slot].about;
+		int clip_id = nm->avoices[slot].clip_id;
+		int ch = nm->clips[clip_id].out;
+		nm_block_st *buf = &nm->lanes[lane][ch];
+		bool fresh = !nm->lanes_used[lane][ch];
+		if (fresh){
+			memset(buf, 0, sizeof(nm_block_st));
+			nm->lanes_used[lane][ch] = true;
+		}
+
+		// glide x/y to the clip's by the end of the block
+		float x = nm->avoices[slot].x;
+		float y = nm->avoices[slot].y;
+		float dx = (nm->clips[clip_id].x / 100.0f - x) / (NM_K - off);
+		float dy = (nm->clips[clip_id].y / 100.0f - y) / (NM_K - off);
+		if (off + size >= NM_K){
+			nm->avoices[slot].x = nm->clips[clip_id].x / 100.0f;
+			nm->avoices[slot].y = nm->clips[clip_id].y / 100.0f;
+		}
+		else{
+			nm->avoices[slot].x = x + dx * size;
+			nm->avoices[slot].y = y + dy * size;
+		}
+
+		#ifdef NM_STATS
+		if (about != stats_about){
+			// active is grouped by about, so this is rarely searched
+			stats_about = about;
+			stats_v = vabout_index(about);
+		}
+		uint64_t t0 = stats_ticks();
+		#endif
+		int res = about->f_render(
+			buf->L + off,
+			buf->R + off,
+			size,
+			nm->vdata[slot],
+			nm->cdata[clip_id],
+			nm->channels[ch].vol + nm->channels[ch].dvol * off, nm->channels[ch].dvol,
+			x, dx,
+			y, dy,
+			nm->governor.quality
+		);
+		#ifdef NM_STATS
+		nm->stats.lanes[lane].ticks[stats_v] += stats_ticks() - t0;
+		nm->stats.lanes[lane].renders[stats_v]++;
+		#endif
+		if (res == RENDER_DONE)
+			nm->avoices[slot].aid = 0;
+		else if (res == RENDER_QUIET && fresh)
+			nm->lanes_used[lane][ch] = false; // nothing's in it, so the strip can skip it
+	}
+}
+
+#ifdef NM_THREADS
+static inline void spin_pause(int *spins){
+	if (++(*spins) < 1000){
+	#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+	#elif defined(__aarch64__)
+		__asm__ volatile("yield");
+	#endif
+	}
+	else
+		sched_yield();
+}
+
+// spins a worker makes before parking (spin_pause's thousand pauses, then a hundred yields), enough
+// to catch back-to-back blocks in a bounce without burning a core between a stream's callbacks
+#define POOL_SPINS  1100
+
+typedef struct {
+	nm_ctx_st *nm;
+	int worker;
+} worker_arg_st;
+
+// start the workers on the next block -- sleepers is read after gen is bumped, and parked workers
+// bump it before reading gen, so with seq_cst at least one of them sees the other
+static void pool_wake(nm_ctx_st *nm){
+	atomic_fetch_add_explicit(&nm->pool.gen, 1, memory_order_seq_cst);
+	if (atomic_load_explicit(&nm->pool.sleepers, memory_order_seq_cst) > 0){
+		pthread_mutex_lock(&nm->pool.lock);
+		pthread_cond_broadcast(&nm->pool.wake);
+		pthread_mutex_unlock(&nm->pool.lock);
+	}
+}
+
+// wait for gen to move past gen, returning the new one
+static unsigned pool_wait(nm_ctx_st *nm, unsigned gen){
+	int spins = 0;
+	unsigned g;
+	while ((g = atomic_load_explicit(&nm->pool.gen, memory_order_acquire)) == gen){
+		if (spins >= POOL_SPINS){
+			pthread_mutex_lock(&nm->pool.lock);
+			atomic_fetch_add_explicit(&nm->pool.sleepers, 1, memory_order_seq_cst);
+			while ((g = atomic_load_explicit(&nm->pool.gen, memory_order_seq_cst)) == gen)
+				pthread_cond_wait(&nm->pool.wake, &nm->pool.lock);
+			atomic_fetch_sub_explicit(&nm->pool.sleepers, 1, memory_order_relaxed);
+			pthread_mutex_unlock(&nm->pool.lock);
+			break;
+		}
+		spin_pause(&spins);
+	}
+	return g;
+}
+
+static void *worker_main(void *arg){
+	worker_arg_st wa = *(worker_arg_st *)arg;
+	nm_ctx_st *nm = wa.nm;
+	unsigned gen = atomic_load_explicit(&nm->pool.gen, memory_order_acquire);
+	atomic_fetch_add_explicit(&nm->pool.done, 1, memory_order_release); // done with wa
+	for (;;){
+		gen = pool_wait(nm, gen);
+		if (atomic_load_explicit(&nm->pool.quit, memory_order_relaxed))
+			break;
+		for (int lane = wa.worker; lane < NM_LANES; lane += nm->pool.size + 1)
+			renderlane(nm, lane);
+		atomic_fetch_add_explicit(&nm->pool.done, 1, memory_order_release);
+	}
+	return NULL;
+}
+
+bool nm_threads_start(nm_ctx_st *nm, int count){
+	nm_threads_stop(nm);
+	count = clampi(count, 0, NM_LANES - 1);
+	if (count <= 0)
+		return true;
+	pthread_mutex_init(&nm->pool.lock, NULL);
+	pthread_cond_init(&nm->pool.wake, NULL);
+	atomic_store(&nm->pool.sleepers, 0);
+	atomic_store(&nm->pool.quit, false);
+	nm->pool.running = true;
+	for (int i = 0; i < count; i++){
+		worker_arg_st wa = { nm, i + 1 };
+		atomic_store(&nm->pool.done, 0);
+		if (pthread_create(&nm->pool.threads[i], NULL, worker_main, &wa) != 0){
+			nm_threads_stop(nm);
+			return false;
+		}
+		nm->pool.size++;
+		// wait for the worker to copy its argument
+		int spins = 0;
+		while (atomic_load_explicit(&nm->pool.done, memory_order_acquire) == 0)
+			spin_pause(&spins);
+	}
+	return true;
+}
+
+void nm_threads_stop(nm_ctx_st *nm){
+	if (!nm->pool.running)
+		return;
+	atomic_store(&nm->pool.quit, true);
+	pool_wake(nm);
+	for (int i = 0; i < nm->pool.size; i++)
+		pthread_join(nm->pool.threads[i], NULL);
+	nm->pool.size = 0;
+	pthread_cond_destroy(&nm->pool.wake);
+	pthread_mutex_destroy(&nm->pool.lock);
+	nm->pool.running = false;
+}
+#endif
+
+// render the lanes for render_off/render_size
+static void renderlanes(nm_ctx_st *nm){
+	#ifdef NM_THREADS
+	if (nm->pool.size > 0 && nm->active_size > 1){
+		// hand the work to the workers, and take lanes 0, size + 1, ... ourselves
+		atomic_store_explicit(&nm->pool.done, 0, memory_order_relaxed);
+		pool_wake(nm);
+		for (int lane = 0; lane < NM_LANES; lane += nm->pool.size + 1)
+			renderlane(nm, lane);
+		int spins = 0;
+		while (atomic_load_explicit(&nm->pool.done, memory_order_acquire) < nm->pool.size)
+			spin_pause(&spins);
+		return;
+	}
+	#endif
+	for (int lane = 0; lane < NM_LANES; lane++)
+		renderlane(nm, lane);
+}
+
+static inline void renderblock(nm_ctx_st *nm, nm_block_st *out){
+	// render a block to out (200 samples, NM_K), overwriting it
+	#ifdef NM_STATS
+	stats_begin(nm);
+	uint64_t t0 = stats_ticks();
+	#endif
+	double gt0 = nm->governor.budget > 0 ? governor_now() : 0;
+	memset(out, 0, sizeof(nm_block_st));
+	song_block(nm);
+	channels_begin(nm);
+	memset(nm->lanes_used, 0, sizeof(nm->lanes_used));
+
+	// split the block at the live events that land inside it
+	events_drain(nm);
+	int off = 0;
+	int e = 0;
+	while (off < NM_K){
+		while (e < nm->events.pending_size && nm->events.pending[e].time <= nm->time + off)
+			event_apply(nm, &nm->events.pending[e++]);
+		int end = NM_K;
+		if (e < nm->events.pending_size && nm->events.pending[e].time < nm->time + NM_K)
+			end = (int)(nm->events.pending[e].time - nm->time);
+		nm->render_off = off;
+		nm->render_size = end - off;
+		renderlanes(nm);
+		off = end;
+	}
+	nm->events.pending_size -= e;
+	memmove(nm->events.pending, &nm->events.pending[e], sizeof(nm_event_st) *
+		nm->events.pending_size);
+
+	reverb_block(nm, out, channels_mix(nm, out));
+
+	#ifdef NM_STATS
+	nm->stats.cur.active = nm->active_size;
+	if (nm->active_size > nm->stats.cur.active_max)
+		nm->stats.cur.active_max = nm->active_size;
+	#endif
+
+	// drop voices that finished, keeping the order
+	int size = 0;
+	for (int i = 0; i < nm->active_size; i++){
+		int slot = nm->active[i];
+		if (nm->avoices[slot].aid)
+			nm->active[size++] = slot;
+		else
+			nm->avfree[nm->avfree_size++] = slot;
+	}
+	nm->active_size = size;
+
+	if (nm->governor.budget > 0)
+		governor_block(nm, governor_now() - gt0);
+
+	nm->time += NM_K;
+	atomic_store_explicit(&nm->events.now, nm->time, memory_order_relaxed);
+	#ifdef NM_STATS
+	stats_end(nm, stats_ticks() - t0);
+	#endif
+}
+
+// add part of a block to the caller's buffer, interleaved or planar
+static inline void block_add(const nm_block_st *b, int from, int size, nm_sample_st *out){
+	for (int i = 0; i < size; i++){
+		out[i].L += b->L[from + i];
+		out[i].R += b->R[from + i];
+	}
+}
+
+static inline void block_addplanar(const nm_block_st *b, int from, int size, float *outL,
+	float *outR){
+	for (int i = 0; i < size; i++){
+		outL[i] += b->L[from + i];
+		outR[i] += b->R[from + i];
+	}
+}
+
+// the engine renders in blocks of size 200 samples (NM_K), so misaligned renders leave the unread
+// end of the last block in the kbuf, to be output first next time
+// adds to out if it isn't NULL, otherwise to outL/outR
+static void render(nm_ctx_st *nm, nm_sample_st *out, float *outL, float *outR, size_t outsize){
+	size_t s = 0;
+	while (s < outsize){
+		if (nm->kbuf_size <= 0){
+			renderblock(nm, &nm->kbuf);
+			nm->kbuf_size = NM_K;
+		}
+		int n = outsize - s < (size_t)nm->kbuf_size ? (int)(outsize - s) : nm->kbuf_size;
+		#ifdef NM_STATS
+		if (n < NM_K && nm->kbuf_size == NM_K)
+			nm->stats.cur.partial++; // the rest waits in kbuf for the next call
+		#endif
+		if (out)
+			block_add(&nm->kbuf, NM_K - nm->kbuf_size, n, &out[s]);
+		else
+			block_addplanar(&nm->kbuf, NM_K - nm->kbuf_size, n, &outL[s], &outR[s]);
+		nm->kbuf_size -= n;
+		s += n;
+	}
+}
+
+void nm_render(nm_ctx_st *nm, nm_sample_st *out, size_t outsize){
+	render(nm, out, NULL, NULL, outsize);
+}
+
+void nm_render_planar(nm_ctx_st *nm, float *outL, float *outR, size_t outsize){
+	render(nm, NULL, outL, outR, outsize);
+}
+
+#ifdef NM_STATS
+nm_stats_st nm_stats(nm_ctx_st *nm){
+	nm_stats_st st;
+	for (;;){
+		unsigned seq = atomic_load_explicit(&nm->stats.seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+		st = nm->stats.pub;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&nm->stats.seq, memory_order_relaxed) == seq)
+			return st;
+	}
+}
+
+void nm_stats_setbudget(nm_ctx_st *nm, float fraction){
+	atomic_store_explicit(&nm->stats.budget_ns, (unsigned)(fraction * NM_K * 1e9f / 48000),
+		memory_order_relaxed);
+}
+
+void nm_stats_reset(nm_ctx_st *nm){
+	atomic_store_explicit(&nm->stats.reset, true, memory_order_release);
+}
+#endif
+
+void nm_channel_setvolume(nm_ctx_st *nm, int channel, int volume){
+	nm->channels[channel].volume = clampi(volume, 0, 100);
+}
+
+void nm_channel_setpan(nm_ctx_st *nm, int channel, int pan){
+	nm->channels[channel].pan = clampi(pan, -100, 100);
+}
+
+void nm_channel_setreverb(nm_ctx_st *nm, int channel, int reverb){
+	nm->channels[channel].reverb = clampi(reverb, 0, 100);
+}
+
+void nm_reverb_setlow(nm_ctx_st *nm, bool low){
+	if (nm->reverb.low && !low){
+		// the upper lines sat idle, so they'd replay stale audio
+		for (int j = 4; j < 8; j++){
+			memset(nm->reverb.lines[j], 0, sizeof(nm->reverb.lines[j]));
+			nm->reverb.damp[j] = 0;
+		}
+	}
+	nm->reverb.low = low;
+}
+
+void nm_governor_setbudget(nm_ctx_st *nm, float fraction){
+	nm->governor.budget = maxf(0, fraction);
+	nm->governor.load = 0;
+	nm->governor.wait = 0;
+	nm->governor.calm = 0;
+}
+
+void nm_setquality(nm_ctx_st *nm, nm_quality quality){
+	nm->governor.quality = clampi(quality, NM_Q_FULL, NM_Q_STEAL);
+	nm->governor.wait = 0;
+	nm->governor.calm = 0;
+}
+
+void nm_song_play(nm_ctx_st *nm){
+	nm->song.playing = true;
+}
+
+void nm_song_stop(nm_ctx_st *nm){
+	nm->song.playing = false;
+	song_releaseall(nm);
+}
+
+void nm_song_seek(nm_ctx_st *nm, int bar){
+	song_releaseall(nm);
+	nm->song.step = clampi(bar, 0, NM_BARS_MAX) * 16;
+	nm->song.tick = 0;
+	for (int c = 0; c < NM_CLIP_MAX; c++)
+		nm->clips[c].next = song_lowerbound(nm, c, nm->song.step);
+}
+
+static void clip_build(nm_ctx_st *nm, int clip_id){
+	const vabout_st *about = nm->clips[clip_id].about;
+	if (about == NULL)
+		return;
+	about->f_build(
+		nm->cdata[clip_id],
+		nm->clips[clip_id].out,
+		nm->clips[clip_id].x / 100.0f,
+		nm->clips[clip_id].y / 100.0f
+	);
+}
+
+// voices already playing keep the old voice until they finish
+void nm_clip_setvoice(nm_ctx_st *nm, int clip_id, int voice_id){
+	// the clip's playing voices render from its cdata, so they're cut before it's reset
+	for (int i = nm->active_size - 1; i >= 0; i--){
+		if (nm->avoices[nm->active[i]].clip_id == clip_id)
+			avoice_release(nm, i);
+	}
+	const vabout_st *about = vabout_find(voice_id);
+	nm->clips[clip_id].voice_id = voice_id;
+	nm->clips[clip_id].about = (void *)about;
+	if (about == NULL)
+		return;
+	nm->clips[clip_id].x = about->voice.x;
+	nm->clips[clip_id].y = about->voice.y;
+	if (about->voice.vtype == NM_VT_SAMPLE)
+		nm->clips[clip_id].u.samplespeed = NM_SS_1X;
+	memset(nm->cdata[clip_id], 0, sizeof(nm->cdata[clip_id]));
+	clip_build(nm, clip_id);
+}
+
+// playing voices glide to a clip's new x/y over the next block
+void nm_clip_setx(nm_ctx_st *nm, int clip_id, int x){
+	nm->clips[clip_id].x = clampi(x, 0, 100);
+	clip_build(nm, clip_id);
+}
+
+void nm_clip_sety(nm_ctx_st *nm, int clip_id, int y){
+	nm->clips[clip_id].y = clampi(y, 0, 100);
+	clip_build(nm, clip_id);
+}
+
+void nm_clip_setxy(nm_ctx_st *nm, int clip_id, int x, int y){
+	nm_clip_setx(nm, clip_id, x);
+	nm_clip_sety(nm, clip_id, y);
+}
+
+void nm_clip_setout(nm_ctx_st *nm, int clip_id, int out){
+	nm->clips[clip_id].out = clampi(out, 0, NM_CHANNELS_MAX - 1);
+	clip_build(nm, clip_id);
+}
+
+void nm_clip_setoscscale(nm_ctx_st *nm, int clip_id, nm_oscscale oscscale){
+	nm->clips[clip_id].u.oscscale = oscscale;
+}
+
+void nm_clip_setsamplespeed(nm_ctx_st *nm, int clip_id, nm_samplespeed samplespeed){
+	nm->clips[clip_id].u.samplespeed = samplespeed;
+}
+
+bool nm_clip_noteon(nm_ctx_st *nm, int clip_id, int note, int velocity){
+	return nm_clip_noteon_at(nm, 0, clip_id, note, velocity);
+}
+
+bool nm_clip_noteoff(nm_ctx_st *nm, int clip_id, int note, int velocity){
+	return nm_clip_noteoff_at(nm, 0, clip_id, note, velocity);
+}
+
+bool nm_clip_noteon_at(nm_ctx_st *nm, uint64_t time, int clip_id, int note, int velocity){
+	return events_push(nm, (nm_event_st){ time, EVENT_NOTEON, clip_id, note, velocity });
+}
+
+bool nm_clip_noteoff_at(nm_ctx_st *nm, uint64_t time, int clip_id, int note, int velocity){
+	return events_push(nm, (nm_event_st){ time, EVENT_NOTEOFF, clip_id, note, velocity });
+}
+
+// insert a note id into clip.order after the notes that start on or before it
+static void clip_order_insert(nm_ctx_st *nm, int clip_id, int note_id){
+	int *order = nm->clips[clip_id].order;
+	const nm_note_st *notes = nm->clips[clip_id].notes;
+	int size = nm->clips[clip_id].notes_size;
+	int lo = 0;
+	int hi = size;
+	while (lo < hi){
+		int mid = (lo + hi) / 2;
+		if (notes[order[mid]].x1 <= notes[note_id].x1)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	memmove(&order[lo + 1], &order[lo], sizeof(int) * (size - lo));
+	order[lo] = note_id;
+	nm->clips[clip_id].notes_size++;
+}
+
+// keeps clip.order sorted with an insertion per edit, and puts the sequencer's cursor back in place
+void nm_clip_setnote(nm_ctx_st *nm, int clip_id, int note_id, nm_note_st note){
+	if (note_id < 0 || note_id >= NM_NOTES_MAX)
+		return;
+	int *order = nm->clips[clip_id].order;
+	int *size = &nm->clips[clip_id].notes_size;
+	if (note_id < *size){
+		for (int i = 0; i < *size; i++){
+			if (order[i] == note_id){
+				memmove(&order[i], &order[i + 1], sizeof(int) * (*size - i - 1));
+				break;
+			}
+		}
+		(*size)--;
+	}
+	else{
+		// grow the clip to include the note, with empty notes in between
+		while (*size < note_id){
+			nm->clips[clip_id].notes[*size] = (nm_note_st){0};
+			clip_order_insert(nm, clip_id, *size);
+		}
+	}
+	nm->clips[clip_id].notes[note_id] = note;
+	clip_order_insert(nm, clip_id, note_id);
+	nm->clips[clip_id].next = song_lowerbound(nm, clip_id, song_pending(nm));
+}
+
+static inline double nowsec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+nm_bounce_st nm_bounce(nm_ctx_st *nm, nm_sample_st *out, uint64_t frames, nm_sink_f sink,
+	void *user){
+	double start = nowsec();
+	uint64_t s = 0;
+	nm_block_st blk;
+	nm_sample_st buf[NM_K];
+	while (s < frames){
+		// anything left in the kbuf from an earlier nm_render goes first, then whole blocks
+		const nm_block_st *b = &nm->kbuf;
+		int from = NM_K - nm->kbuf_size;
+		int n = nm->kbuf_size;
+		if (n <= 0){
+			// a final partial block goes through the kbuf, so its rest is output next time
+			if (frames - s < NM_K){
+				renderblock(nm, &nm->kbuf);
+				nm->kbuf_size = NM_K;
+			}
+			else{
+				b = &blk;
+				renderblock(nm, &blk);
+			}
+			from = 0;
+			n = NM_K;
+		}
+		if (frames - s < (uint64_t)n)
+			n = (int)(frames - s);
+		if (out)
+			block_add(b, from, n, &out[s]);
+		else{
+			memset(buf, 0, sizeof(nm_sample_st) * n);
+			block_add(b, from, n, buf);
+			sink(user, buf, n);
+		}
+		if (b == &nm->kbuf)
+			nm->kbuf_size -= n;
+		s += n;
+	}
+
+	double seconds = nowsec() - start;
+	return (nm_bounce_st){
+		.frames = frames,
+		.seconds = seconds,
+		.realtime = seconds > 0 ? frames / 48000.0 / seconds : 0
+	};
+}
+
+#ifdef NM_THREADS
+#if NM_AHEAD_MAX & (NM_AHEAD_MAX - 1)
+#error NM_AHEAD_MAX must be a power of 2
+#endif
+
+static void *ahead_main(void *arg){
+	nm_ctx_st *nm = arg;
+	while (!atomic_load_explicit(&nm->ahead.quit, memory_order_relaxed)){
+		unsigned head = atomic_load_explicit(&nm->ahead.head, memory_order_relaxed);
+		unsigned tail = atomic_load_explicit(&nm->ahead.tail, memory_order_acquire);
+		if (head - tail >= (unsigned)nm->ahead.size){
+			// full, check back in a quarter of a block
+			nanosleep(&(struct timespec){ 0, 1000000000L / 48000 * NM_K / 4 }, NULL);
+			continue;
+		}
+		renderblock(nm, &nm->ahead.ring[head % NM_AHEAD_MAX]);
+		atomic_store_explicit(&nm->ahead.head, head + 1, memory_order_release);
+	}
+	return NULL;
+}
+
+bool nm_ahead_start(nm_ctx_st *nm, int blocks){
+	nm_ahead_stop(nm);
+	nm->ahead.size = clampi(blocks, 1, NM_AHEAD_MAX);
+	unsigned head = nm->time / NM_K;
+	unsigned tail = head;
+	nm->ahead.pos = 0;
+	if (nm->kbuf_size > 0){
+		// the rest of the last block nm_render made is the first thing read
+		tail--;
+		nm->ahead.ring[tail % NM_AHEAD_MAX] = nm->kbuf;
+		nm->ahead.pos = NM_K - nm->kbuf_size;
+		nm->kbuf_size = 0;
+	}
+	atomic_store(&nm->ahead.head, head);
+	atomic_store(&nm->ahead.tail, tail);
+	atomic_store(&nm->ahead.quit, false);
+	if (pthread_create(&nm->ahead.thread, NULL, ahead_main, nm) != 0)
+		return false;
+	nm->ahead.running = true;
+	return true;
+}
+
+void nm_ahead_stop(nm_ctx_st *nm){
+	if (!nm->ahead.running)
+		return;
+	atomic_store(&nm->ahead.quit, true);
+	pthread_join(nm->ahead.thread, NULL);
+	nm->ahead.running = false;
+}
+
+// adds to out if it isn't NULL, otherwise to outL/outR
+static void ahead_read(nm_ctx_st *nm, nm_sample_st *out, float *outL, float *outR,
+	size_t outsize){
+	size_t i = 0;
+	while (i < outsize){
+		unsigned tail = atomic_load_explicit(&nm->ahead.tail, memory_order_relaxed);
+		unsigned head = atomic_load_explicit(&nm->ahead.head, memory_order_acquire);
+		if (tail == head){
+			// the producer fell behind, leave the rest of out alone
+			atomic_fetch_add_explicit(&nm->ahead.underruns, 1, memory_order_relaxed);
+			return;
+		}
+		const nm_block_st *buf = &nm->ahead.ring[tail % NM_AHEAD_MAX];
+		int n = mini(NM_K - nm->ahead.pos, outsize - i);
+		if (out)
+			block_add(buf, nm->ahead.pos, n, &out[i]);
+		else
+			block_addplanar(buf, nm->ahead.pos, n, &outL[i], &outR[i]);
+		i += n;
+		nm->ahead.pos += n;
+		if (nm->ahead.pos >= NM_K){
+			nm->ahead.pos = 0;
+			atomic_store_explicit(&nm->ahead.tail, tail + 1, memory_order_release);
+		}
+	}
+}
+
+void nm_ahead_read(nm_ctx_st *nm, nm_sample_st *out, size_t outsize){
+	ahead_read(nm, out, NULL, NULL, outsize);
+}
+
+void nm_ahead_read_planar(nm_ctx_st *nm, float *outL, float *outR, size_t outsize){
+	ahead_read(nm, NULL, outL, outR, outsize);
+}
+#endif
@@ -25,9 +25,97 @@
 #define NM_AVOICES_MAX   (16 + NM_CHANNELS_MAX * 8)
 #endif
 
+// most notes a single avoice plays at once, for voices that play chords in one avoice
+#ifndef NM_CHORD_MAX
+#define NM_CHORD_MAX     8
+#endif
+
+// active voices are split into this many lanes per block, each rendered into its own buffer and
+// summed in lane order, so output is identical no matter how many threads did the rendering
+#ifndef NM_LANES
+#define NM_LANES         4
+#endif
+
+// bytes of state each playing voice and each clip gets -- multiples of 64 so every voice's state
+// starts on its own cache line, and the defaults are exactly the largest voice's vst and cst
+// rounded up to that, which the build checks
+#ifndef NM_VDATA_SIZE
+#define NM_VDATA_SIZE    576
+#define NM_VDATA_DEFAULT
+#endif
+
+#ifndef NM_CDATA_SIZE
+#define NM_CDATA_SIZE    64
+#define NM_CDATA_DEFAULT
+#endif
+
+// size of the render-ahead ring in k-blocks (power of 2), i.e., the most latency nm_ahead_start can
+// be asked for
+#ifndef NM_AHEAD_MAX
+#define NM_AHEAD_MAX     16
+#endif
+
+// size of the arena that sample voices are decoded into at nm_init, in stereo frames
+#ifndef NM_SAMPLES_FRAMES
+#define NM_SAMPLES_FRAMES (48000 * 30)
+#endif
+
+// with NM_THREADS, samples longer than NM_STREAM_MIN frames aren't decoded into the arena, they're
+// streamed by a decoder thread into one of NM_STREAMS_MAX rings of NM_STREAM_FRAMES frames each
+// (a power of 2), which caps the memory per playing stream -- only their first NM_STREAM_HEAD
+// frames are decoded into the arena, which covers the decoder's latency when a note starts
+#ifndef NM_STREAM_MIN
+#define NM_STREAM_MIN    (48000 * 10)
+#endif
+
+#ifndef NM_STREAM_HEAD
+#define NM_STREAM_HEAD   8192
+#endif
+
+#ifndef NM_STREAMS_MAX
+#define NM_STREAMS_MAX   8
+#endif
+
+#ifndef NM_STREAM_FRAMES
+#define NM_STREAM_FRAMES 16384
+#endif
+
+// number of samples between filter coefficient updates, with the coefficients gliding linearly in
+// between -- set to 1 to compute coefficients every sample (useful to null test against)
+#ifndef NM_FILTER_RATE
+#define NM_FILTER_RATE   25
+#endif
+
+// level below which voices and the reverb count as silent and stop doing work, until they'd be
+// heard again (-100dBFS) -- set to 0 to never skip anything (useful to null test against)
+#ifndef NM_SILENCE
+#define NM_SILENCE       0.00001f
+#endif
+
+// size of the queue of timestamped live events (power of 2), i.e., how many nm_clip_noteon/noteoff
+// calls can be waiting on the audio thread at once -- pushes past that are dropped and counted
+#ifndef NM_EVENTS_MAX
+#define NM_EVENTS_MAX    256
+#endif
+
+// how far past nm_time a live event can be timestamped, in samples -- events wait in the queue
+// until their block, so ones further out are refused rather than left crowding out sooner ones
+#ifndef NM_EVENTS_HORIZON
+#define NM_EVENTS_HORIZON (48000 * 4)
+#endif
+
+// length of each reverb delay line, in samples -- a power of 2 that fits the longest delay plus a
+// k-block
+#define NM_REVERB_SIZE   4096
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+
+#ifdef NM_THREADS
+#include <pthread.h>
+#endif
 
 // k-block size, i.e., number of samples in a rendered block
 // do not change or you'll screw everything up :-)
@@ -38,6 +126,13 @@ typedef struct {
 	float R;
 } nm_sample_st;
 
+// a k-block of planar audio, which is how everything is rendered internally -- nm_sample_st is
+// only used at the edges, for callers that want interleaved audio
+typedef struct {
+	_Alignas(32) float L[NM_K];
+	_Alignas(32) float R[NM_K];
+} nm_block_st;
+
 typedef enum {
 	NM_VT_POLY,
 	NM_VT_MONO,
@@ -104,20 +199,129 @@ typedef enum {
 	NM_FX_CLIPY
 } nm_fx;
 
+// render quality, from best to cheapest -- each tier also does what the ones before it do
+typedef enum {
+	NM_Q_FULL,
+	NM_Q_FILTER, // filters update once per block instead of every NM_FILTER_RATE samples
+	NM_Q_UNISON, // voices play half their unison oscillators, rounded up
+	NM_Q_ALIAS,  // oscillators aren't band-limited (no polyBLEP or oversampling)
+	NM_Q_STEAL   // the governor steals the lowest priority avoice every block that's over budget
+} nm_quality;
+
+typedef struct {
+	uint64_t time;
+	int type;
+	int clip_id;
+	int note;
+	int velocity;
+} nm_event_st;
+
+#ifdef NM_STATS
+// most voices the stats break render time down by
+#ifndef NM_STATS_VOICES
+#define NM_STATS_VOICES  16
+#endif
+
 typedef struct {
-	nm_sample_st kbuf[NM_K];
-	int kbuf_size;
+	uint64_t blocks;      // k-blocks rendered
+	uint64_t over_budget; // blocks that took longer than the budget
+	uint64_t partial;     // blocks only partly read by the nm_render call that rendered them
+	uint64_t steals;      // avoices taken from a playing note to start another
+	int active;           // avoices rendered in the last block
+	int active_max;       // most avoices rendered in any block
+	double block_ns;      // time spent rendering the last block
+	double block_ns_max;
+	double block_ns_avg;
+	int voices_size;
+	struct {
+		int voice_id;
+		uint64_t renders; // avoice renders, with blocks split by events counting each part
+		double ns;        // time spent in them
+	} voices[NM_STATS_VOICES];
+} nm_stats_st;
+#endif
+
+typedef struct {
+	nm_block_st kbuf;
+	int kbuf_size; // samples at the end of kbuf not output yet
 	int tempo; // stored as number of k-blocks before advancing a 1/16th note
+	uint64_t time; // samples rendered so far, the clock for timestamped events
+	// the bookkeeping for each avoice is kept small and dense, and the state its voice renders from
+	// lives apart in vdata, so walking the active list doesn't stride through synth state
 	struct {
 		int aid;
-		int priority;
 		int clip_id;
 		void *about;
 		float x;
 		float y;
-		float out;
-		uint64_t vdata[100];
+		int priority;
 	} avoices[NM_AVOICES_MAX];
+	// notes started on each avoice and not released yet (at most one, unless its voice plays
+	// chords) -- only noteons and noteoffs look at them, so they're kept out of avoices
+	struct {
+		int notes;
+		int ids; // handed out to the notes started on the avoice so far
+		int16_t note[NM_CHORD_MAX];
+		int id[NM_CHORD_MAX]; // which of the voice's notes it is, for voices that play chords
+		int16_t end[NM_CHORD_MAX]; // 1/16th note the sequencer releases it on, or -1
+		bool held[NM_CHORD_MAX]; // live note waiting for its noteoff
+	} avnotes[NM_AVOICES_MAX];
+	_Alignas(64) uint8_t vdata[NM_AVOICES_MAX][NM_VDATA_SIZE];
+	_Alignas(64) uint8_t cdata[NM_CLIP_MAX][NM_CDATA_SIZE];
+	int aid_next;
+	int active[NM_AVOICES_MAX]; // dense list of live avoices, grouped by voice
+	int active_size;
+	int avfree[NM_AVOICES_MAX]; // stack of unused avoices
+	int avfree_size;
+	// each lane renders its voices into per-channel buffers, which are summed in lane order
+	int render_off; // part of the block being rendered, split at event times
+	int render_size;
+	nm_block_st lanes[NM_LANES][NM_CHANNELS_MAX];
+	bool lanes_used[NM_LANES][NM_CHANNELS_MAX];
+	struct {
+		int volume; // 0 to 100
+		int pan;    // -100 (left) to 100 (right)
+		int reverb; // send level, 0 to 100
+		// smoothed gains, ramped to the targets over each block
+		float vol;
+		float dvol;
+		float gl;
+		float gr;
+		float send;
+	} channels[NM_CHANNELS_MAX];
+	nm_block_st send; // reverb send bus
+	struct {
+		float lines[8][NM_REVERB_SIZE];
+		float damp[8]; // lowpass state of each feedback path
+		int pos;
+		int tail; // blocks left before the lines have decayed to nothing
+		int quiet; // blocks in a row the output has been below NM_SILENCE
+		bool low; // run 4 delay lines instead of 8
+	} reverb;
+	#ifdef NM_THREADS
+	struct {
+		pthread_t threads[NM_LANES - 1];
+		int size;
+		atomic_uint gen; // bumped by the audio thread to start a block
+		atomic_int done; // number of workers finished with the block
+		atomic_int sleepers; // workers parked on wake
+		atomic_bool quit;
+		bool running;
+		pthread_mutex_t lock;
+		pthread_cond_t wake;
+	} pool;
+	struct {
+		nm_block_st ring[NM_AHEAD_MAX];
+		int size;         // number of blocks the producer keeps queued
+		int pos;          // samples already read from the tail block
+		atomic_uint head; // blocks written (producer)
+		atomic_uint tail; // blocks read (consumer)
+		atomic_uint underruns;
+		atomic_bool quit;
+		bool running;
+		pthread_t thread;
+	} ahead;
+	#endif
 	struct {
 		int voice_id;
 		int x;
@@ -129,17 +333,144 @@ typedef struct {
 		} u;
 		nm_note_st notes[NM_NOTES_MAX];
 		int notes_size;
-		uint64_t cdata[100];
+		int order[NM_NOTES_MAX]; // note ids sorted by x1
+		int next; // index into order of the next note for the sequencer to start
+		void *about;
 	} clips[NM_CLIP_MAX];
+	struct {
+		// bounded multi-producer queue, each cell's seq says whose turn it is
+		struct {
+			atomic_uint seq;
+			nm_event_st ev;
+		} ring[NM_EVENTS_MAX];
+		atomic_uint head; // next cell to push (producers)
+		unsigned tail;    // next cell to pop (audio thread)
+		atomic_uint dropped;
+		atomic_uint toofar;
+		atomic_uint highwater; // most events waiting on a single block
+		atomic_uint_least64_t now; // nm->time, readable from any thread
+		// popped events waiting for their block, sorted by time (audio thread only)
+		nm_event_st pending[NM_EVENTS_MAX];
+		int pending_size;
+	} events;
+	struct {
+		bool playing;
+		int step; // 1/16th note being played
+		int tick; // k-blocks into the step
+	} song;
+	struct {
+		float budget; // fraction of a k-block's duration a block may take, 0 when off
+		float load;   // smoothed block render time, as a fraction of the budget
+		nm_quality quality;
+		int wait; // blocks since quality last changed
+		int calm; // blocks in a row the load has been low
+	} governor;
+	#ifdef NM_STATS
+	struct {
+		// published after every block, with a sequence lock so any thread can read it
+		atomic_uint seq; // odd while publishing
+		nm_stats_st pub;
+		atomic_uint budget_ns;
+		atomic_bool reset;
+		// counted by the rendering thread, and by each lane for the voices it renders
+		nm_stats_st cur;
+		_Alignas(64) struct {
+			uint64_t ticks[NM_STATS_VOICES];
+			uint64_t renders[NM_STATS_VOICES];
+		} lanes[NM_LANES];
+	} stats;
+	#endif
 } nm_ctx_st, *nm_ctx;
 
+typedef void (*nm_sink_f)(void *user, const nm_sample_st *buf, size_t size);
+
+typedef struct {
+	uint64_t frames;
+	double seconds;  // wall-clock time spent rendering
+	double realtime; // seconds of audio rendered per wall-clock second
+} nm_bounce_st;
+
 extern const nm_voice_st *nm_voices[];
 
-// initialize everything (once)
-void nm_init();
+// initialize everything, which decodes the opus files of every sample voice from samples_path
+// (NULL to skip) -- returns false if a sample failed to open, decode, or fit in the arena, or
+// (without NDEBUG) if the voice list isn't sorted by voice_id
+// a sample that failed just plays nothing (see nm_samples_missing), the rest of the engine works,
+// and calling nm_init again retries only the samples that failed
+// with NM_STATS, it also spends 2ms timing the cycle counter against the clock
+// (this used to be `void nm_init()` -- callers without sample voices become `nm_init(NULL)`)
+bool nm_init(const char *samples_path);
 void nm_clear(nm_ctx nm);
 void nm_render(nm_ctx nm, nm_sample_st *out, size_t outsize);
 
+// same as nm_render, but adds to separate left and right buffers
+void nm_render_planar(nm_ctx nm, float *outL, float *outR, size_t outsize);
+
+// offline render of `frames` frames as fast as possible, either added to out (like nm_render), or,
+// if out is NULL, streamed through sink in k-blocks -- renders whole blocks directly, only putting
+// a final partial block in the kbuf (like nm_render), and uses the worker pool if it's running
+// contexts only share what nm_init sets up (read-only after it returns) and, with NM_THREADS, the
+// NM_STREAMS_MAX streams (claimed atomically), so separate stems can also be bounced from separate
+// threads, as long as nm_init isn't running at the same time
+nm_bounce_st nm_bounce(nm_ctx nm, nm_sample_st *out, uint64_t frames, nm_sink_f sink, void *user);
+
+#ifdef NM_THREADS
+typedef struct {
+	int active;              // streams currently playing
+	unsigned starved_frames; // frames that weren't decoded in time and played as silence
+	unsigned starved_reads;  // reads that came up short
+} nm_stream_stats_st;
+
+// start/stop the background decoder that feeds streamed samples
+bool nm_stream_start();
+void nm_stream_stop();
+nm_stream_stats_st nm_stream_stats();
+#endif
+
+static inline uint64_t nm_bounce_frames(nm_ctx nm, int bars){
+	// 16 1/16th notes per bar
+	return (uint64_t)bars * 16 * nm->tempo * NM_K;
+}
+
+#ifdef NM_THREADS
+// start worker threads that help nm_render (at most NM_LANES - 1), and stop them -- don't call
+// nm_clear while threads are running
+bool nm_threads_start(nm_ctx nm, int count);
+void nm_threads_stop(nm_ctx nm);
+
+// render ahead: a producer thread keeps `blocks` k-blocks (1 to NM_AHEAD_MAX) rendered in advance,
+// and nm_ahead_read just adds them to out, so it's safe to call from a tight audio callback -- more
+// blocks means more latency, but more slack before an underrun (which outputs nothing)
+// whatever nm_render left in the kbuf is read first, so switching over doesn't skip anything
+// the producer is the audio thread while it runs, so besides nm_ahead_read, other threads can only
+// call the live notes (nm_clip_noteon/noteoff and their _at versions), nm_time, nm_event_stats,
+// nm_stats, nm_ahead_time, and nm_ahead_underruns -- the setters, nm_song_*, nm_clip_setnote,
+// nm_render, and nm_clear have to wait for nm_ahead_stop
+bool nm_ahead_start(nm_ctx nm, int blocks);
+void nm_ahead_stop(nm_ctx nm);
+void nm_ahead_read(nm_ctx nm, nm_sample_st *out, size_t outsize);
+void nm_ahead_read_planar(nm_ctx nm, float *outL, float *outR, size_t outsize);
+
+// sample time currently being read by nm_ahead_read, which trails nm->time by the latency
+static inline uint64_t nm_ahead_time(nm_ctx nm){
+	return (uint64_t)atomic_load_explicit(&nm->ahead.tail, memory_order_relaxed) * NM_K +
+		nm->ahead.pos;
+}
+
+// number of nm_ahead_read calls that found the ring empty, readable from any thread
+static inline unsigned nm_ahead_underruns(nm_ctx nm){
+	return atomic_load_explicit(&nm->ahead.underruns, memory_order_relaxed);
+}
+#endif
+
+// decoded sample memory, for budgeting
+size_t nm_samples_bytes(int voice_id); // used by a single voice
+size_t nm_samples_used();
+size_t nm_samples_capacity();
+
+// samples of a sample voice that didn't load at nm_init, 0 once they all did
+int nm_samples_missing(int voice_id);
+
 static inline float nm_getbpmfromtempo(int tempo){
 	return 3600.0f / tempo;
 }
@@ -148,7 +479,58 @@ static inline float nm_getbpm(nm_ctx nm){
 	return nm_getbpmfromtempo(nm->tempo);
 }
 
-// clip
+// song sequencer, which plays every clip's notes -- note x1/x2 are the 1/16th notes the note starts
+// and stops on, counting from the start of the song, and y1 is the note in the clip's oscscale (or
+// the sample to play, for a sample voice)
+void nm_song_play(nm_ctx nm);
+void nm_song_stop(nm_ctx nm); // releases the sequenced notes
+void nm_song_seek(nm_ctx nm, int bar);
+
+static inline bool nm_song_playing(nm_ctx nm){
+	return nm->song.playing;
+}
+
+static inline int nm_song_getbar(nm_ctx nm){
+	return nm->song.step / 16;
+}
+
+// channel strips, which voices render into based on their clip's out
+void nm_channel_setvolume(nm_ctx nm, int channel, int volume);
+void nm_channel_setpan(nm_ctx nm, int channel, int pan);
+void nm_channel_setreverb(nm_ctx nm, int channel, int reverb);
+
+static inline int nm_channel_getvolume(nm_ctx nm, int channel){
+	return nm->channels[channel].volume;
+}
+
+static inline int nm_channel_getpan(nm_ctx nm, int channel){
+	return nm->channels[channel].pan;
+}
+
+static inline int nm_channel_getreverb(nm_ctx nm, int channel){
+	return nm->channels[channel].reverb;
+}
+
+// the reverb runs once per block on the sum of the strips' sends -- low quality halves its cost
+void nm_reverb_setlow(nm_ctx nm, bool low);
+
+static inline bool nm_reverb_getlow(nm_ctx nm){
+	return nm->reverb.low;
+}
+
+// the governor times every block, and when they take longer than the budget (a fraction of the
+// NM_K / 48000 seconds a block lasts) it lowers the quality a tier at a time, raising it again once
+// blocks have been comfortably under budget for a second -- 0 turns it off, leaving the quality
+// wherever nm_setquality or the governor last put it
+void nm_governor_setbudget(nm_ctx nm, float fraction);
+void nm_setquality(nm_ctx nm, nm_quality quality);
+
+static inline nm_quality nm_getquality(nm_ctx nm){
+	return nm->governor.quality;
+}
+
+// clip -- setting the voice cuts the notes the clip is playing, setting a sample voice resets the
+// clip to NM_SS_1X, and a live note on a sample voice picks the sample to play (0 to 14)
 void nm_clip_setvoice(nm_ctx nm, int clip_id, int voice_id);
 void nm_clip_setx(nm_ctx nm, int clip_id, int x);
 void nm_clip_sety(nm_ctx nm, int clip_id, int y);
@@ -157,8 +539,49 @@ void nm_clip_setout(nm_ctx nm, int clip_id, int out);
 void nm_clip_setoscscale(nm_ctx nm, int clip_id, nm_oscscale oscscale);
 void nm_clip_setsamplespeed(nm_ctx nm, int clip_id, nm_samplespeed samplespeed);
 void nm_clip_setnote(nm_ctx nm, int clip_id, int note_id, nm_note_st note);
-void nm_clip_noteon(nm_ctx nm, int clip_id, int note, int velocity);
-void nm_clip_noteoff(nm_ctx nm, int clip_id, int note, int velocity);
+
+// live notes, which are safe to call from any thread while the audio thread renders -- `note` is in
+// the clip's oscscale, like a note's y1, and `time` is the sample (on the nm_time clock) to trigger
+// on, landing on the exact sample inside a block -- times already rendered trigger as soon as
+// possible, which is all that nm_clip_noteon/noteoff do
+// returns false if the event was dropped, because the event queue was full or `time` is more than
+// NM_EVENTS_HORIZON samples past nm_time
+bool nm_clip_noteon(nm_ctx nm, int clip_id, int note, int velocity);
+bool nm_clip_noteoff(nm_ctx nm, int clip_id, int note, int velocity);
+bool nm_clip_noteon_at(nm_ctx nm, uint64_t time, int clip_id, int note, int velocity);
+bool nm_clip_noteoff_at(nm_ctx nm, uint64_t time, int clip_id, int note, int velocity);
+
+// samples rendered so far, readable from any thread
+static inline uint64_t nm_time(nm_ctx nm){
+	return atomic_load_explicit(&nm->events.now, memory_order_relaxed);
+}
+
+typedef struct {
+	unsigned dropped;   // events pushed while the queue was full
+	unsigned toofar;    // events timestamped past NM_EVENTS_HORIZON
+	unsigned highwater; // most events waiting on the audio thread at once
+} nm_event_stats_st;
+
+static inline nm_event_stats_st nm_event_stats(nm_ctx nm){
+	return (nm_event_stats_st){
+		atomic_load_explicit(&nm->events.dropped, memory_order_relaxed),
+		atomic_load_explicit(&nm->events.toofar, memory_order_relaxed),
+		atomic_load_explicit(&nm->events.highwater, memory_order_relaxed)
+	};
+}
+
+#ifdef NM_STATS
+// render statistics as of the last block, readable from any thread without locking (it retries
+// while a block is being published)
+nm_stats_st nm_stats(nm_ctx nm);
+
+// count blocks that take longer than this fraction of a k-block's duration (NM_K / 48000 seconds)
+// as over budget -- the default is 1, i.e., blocks that missed their deadline
+void nm_stats_setbudget(nm_ctx nm, float fraction);
+
+// zero the counters, from any thread, starting with the next block
+void nm_stats_reset(nm_ctx nm);
+#endif
 
 static inline int nm_clip_getvoice(nm_ctx nm, int clip_id){
 	return nm->clips[clip_id].voice_id;
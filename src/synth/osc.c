@@ -2,35 +2,82 @@
 // MIT License
 // Project Home: https://github.com/velipso/nightmare
 
-#if !defined(OSC_CURVE)
-	#define __OSC__UNDEF__CURVE__
-	#if defined(OSC_SINE)
-		#define OSC_CURVE(ang)    sinf(ang * TAU)
+// curves are written without branches so the block loop in NAME(poly_render) vectorizes -- steps
+// come from truncating to int, which is the same as floor since ang is always in [0, 1)
+// with OSC_POLYBLEP, the edges and corners of the curves are band-limited as they're generated
+// instead of oversampled, so it's meant to be used without OVERSAMPLE -- it costs about what
+// OVERSAMPLE 2 does and rejects more aliasing, but not as much as OVERSAMPLE 8 does on hard edges
+// OSC_CURVE_NAIVE is the curve without any band-limiting, played at 1x from NM_Q_ALIAS down
+#if !defined(OSC_CURVE_NAIVE)
+	#define __OSC__UNDEF__CURVE_NAIVE__
+	#if defined(OSC_CURVE)
+		#define OSC_CURVE_NAIVE(ang)  OSC_CURVE(ang)
+	#elif defined(OSC_SINE)
+		#define OSC_CURVE_NAIVE(ang)  osc_sine(ang)
 	#elif defined(OSC_SQUARE)
-		#define OSC_CURVE(ang)    ang < duty ? -1 : 1
+		#define OSC_CURVE_NAIVE(ang)  (2.0f * (float)(int)(ang - duty + 1.0f) - 1.0f)
 	#elif defined(OSC_SAW)
-		#define OSC_CURVE(ang)    ang < 0.5f ? 2.0f * ang : -2.0f + 2.0f * ang
+		#define OSC_CURVE_NAIVE(ang)  (2.0f * (ang - (float)(int)(ang + 0.5f)))
 	#elif defined(OSC_TRIANGLE)
-		#define OSC_CURVE(ang)    ang < 0.25f ? ang * 4.0f : ang < 0.75f ? 2.0f - 4.0f * ang : 4.0f * ang - 4.0f
+		#define OSC_CURVE_NAIVE(ang)  (1.0f - 4.0f * absf(ang - 0.25f - (float)(int)(ang + 0.25f)))
+	#endif
+#endif
+
+#if !defined(OSC_CURVE)
+	#define __OSC__UNDEF__CURVE__
+	#if defined(OSC_POLYBLEP) && defined(OSC_SINE)
+		#define OSC_CURVE(ang)    osc_sine(ang)
+	#elif defined(OSC_POLYBLEP) && defined(OSC_SQUARE)
+		#define OSC_CURVE(ang)    osc_square_blep(ang, duty, step, istep)
+	#elif defined(OSC_POLYBLEP) && defined(OSC_SAW)
+		#define OSC_CURVE(ang)    osc_saw_blep(ang, step, istep)
+	#elif defined(OSC_POLYBLEP) && defined(OSC_TRIANGLE)
+		#define OSC_CURVE(ang)    osc_triangle_blamp(ang, step, istep)
+	#elif defined(OSC_SINE) || defined(OSC_SQUARE) || defined(OSC_SAW) || defined(OSC_TRIANGLE)
+		#define OSC_CURVE(ang)    OSC_CURVE_NAIVE(ang)
 	#else
 		#error Missing oscillator type or curve
 	#endif
 #endif
 
-typedef struct {
-	int note;
-	float dang;
-} NAME(note_st);
+#if !defined(OVERSAMPLE)
+	#define __OSC__UNDEF__OVERSAMPLE__
+	#define OVERSAMPLE 1
+#endif
 
-// data per voice
-typedef struct {
-	biquad_st bq;
-	oversample_st os[UNISON];
-	envelope_st env;
-	float ang[UNISON];
-	NAME(note_st) notes[15];
-	int nextnote;
-} NAME(vst);
+// number of 2x half-band stages needed to decimate
+#if OVERSAMPLE == 1
+	#define OSC_STAGES 0
+#elif OVERSAMPLE == 2
+	#define OSC_STAGES 1
+#elif OVERSAMPLE == 4
+	#define OSC_STAGES 2
+#elif OVERSAMPLE == 8
+	#define OSC_STAGES 3
+#elif OVERSAMPLE == 16
+	#define OSC_STAGES 4
+#else
+	#error OVERSAMPLE must be 1, 2, 4, 8, or 16
+#endif
+
+// with POLY_NOTES above 1, one avoice plays up to that many notes of its clip at once, each with its
+// own phases and envelope, summed before a single filter -- the filter is linear and its parameters
+// only depend on the clip, so sharing it sounds the same as filtering each note, at a fraction of
+// the cost, and a chord only takes one avoice
+// each note is still vectorized across the block's samples -- putting the notes in vector lanes
+// instead pays for padding and a transpose, and measures slower even for a full chord (bench chord)
+#if !defined(POLY_NOTES)
+	#define __OSC__UNDEF__POLY_NOTES__
+	#define POLY_NOTES 1
+#endif
+
+#if POLY_NOTES > 1 && OVERSAMPLE > 1
+	#error POLY_NOTES needs a curve that runs at 1x, like OSC_POLYBLEP
+#endif
+
+_Static_assert(POLY_NOTES <= NM_CHORD_MAX, "POLY_NOTES is more than NM_CHORD_MAX");
+
+enum { NAME(chord) = POLY_NOTES };
 
 // data per clip
 typedef struct {
@@ -45,9 +92,307 @@ static void NAME(poly_build)(
 ){
 }
 
-static void NAME(poly_noteon)(
+// the voice's macros read x and y by name, so these give them values other than the arguments
+static inline __attribute__((always_inline)) void NAME(filter_at)(
+	biquad_st *bq,
+	const float x,
+	const float y
+){
+	PARAM_FILTER(bq);
+	(void)x;
+	(void)y;
+}
+
+static inline __attribute__((always_inline)) float NAME(duty_at)(
+	const float y
+){
+	float duty = 0;
+	DUTY();
+	(void)y;
+	return duty;
+}
+
+static inline __attribute__((always_inline)) void NAME(detune)(
+	float *dang,
+	float dang0,
+	const float y
+){
+	dang[0] = dang0;
+	for (int u = 1; u < UNISON; u++)
+		dang[u] = dang[0] * UNISON_DETUNE(u);
+}
+
+// generate the oscillators for size samples up front, summing the unison voices at the oversampled
+// rate (os), in a straight-line loop over the samples so it vectorizes across samples
+// only the first `units` unison voices are generated, the rest just have their phases moved on, and
+// the sum is scaled up by the square root of what's missing, since detuned voices add up in power
+static inline __attribute__((always_inline)) void NAME(generate_at)(
+	float *w,
+	float *angs,
+	float dang0,
+	const int size,
+	const float y,
+	const float dy,
+	const int os,
+	const bool naive,
+	const int units
+){
+	float dang[UNISON];
+	NAME(detune)(dang, dang0, y);
+	memset(w, 0, sizeof(float) * size * os);
+	const float wy = y;
+	for (int u = 0; u < units; u++){
+		const float ang0 = angs[u];
+		const float step = dang[u] / os;
+		const float istep = 1.0f / step;
+		(void)istep;
+		for (int n = 0; n < size * os; n++){
+			const float duty = NAME(duty_at)(wy + (float)(n / os) * dy);
+			(void)duty;
+			// phases are positive, so truncation is the same as floor, and cheaper
+			float ang = ang0 + n * step;
+			ang -= (float)(int)ang;
+			w[n] += naive ? OSC_CURVE_NAIVE(ang) : OSC_CURVE(ang);
+		}
+		float ang = ang0 + size * dang[u];
+		angs[u] = ang - (float)(int)ang;
+	}
+	for (int u = units; u < UNISON; u++){
+		float ang = angs[u] + size * dang[u];
+		angs[u] = ang - (float)(int)ang;
+	}
+	if (units < UNISON){
+		const float gain = sqrtf((float)UNISON / units);
+		for (int n = 0; n < size * os; n++)
+			w[n] *= gain;
+	}
+}
+
+// generate at the quality's tier, each tier getting its own copy of the loop -- from NM_Q_ALIAS
+// down, w holds size samples at 1x instead of size * OVERSAMPLE
+static inline __attribute__((always_inline)) void NAME(generate)(
+	float *w,
+	float *angs,
+	float dang0,
+	const int size,
+	const float y,
+	const float dy,
+	const int quality
+){
+	const int units = quality >= NM_Q_UNISON ? (UNISON + 1) / 2 : UNISON;
+	if (quality >= NM_Q_ALIAS)
+		NAME(generate_at)(w, angs, dang0, size, y, dy, 1, true, units);
+	else
+		NAME(generate_at)(w, angs, dang0, size, y, dy, OVERSAMPLE, false, units);
+}
+
+// move the phases ahead as if size samples were generated, for skipping silent blocks
+static inline __attribute__((always_inline)) void NAME(advance)(
+	float *angs,
+	float dang0,
+	const int size,
+	const float y
+){
+	float dang[UNISON];
+	NAME(detune)(dang, dang0, y);
+	for (int u = 0; u < UNISON; u++){
+		float ang = angs[u] + size * dang[u];
+		angs[u] = ang - (float)(int)ang;
+	}
+}
+
+// with nothing audible going in and the filter rung out, the filter sleeps instead of running --
+// it's flushed, and set to where its glide would have ended, so it wakes up clean
+// (peak is the envelope's, times UNISON, which bounds the input as long as ENVELOPE_STEP scales by
+// the envelope)
+static inline __attribute__((always_inline)) bool NAME(sleep)(
+	biquad_st *bq,
+	float peak,
+	const int size,
+	float x, float dx,
+	float y, float dy
+){
+	if (peak >= NM_SILENCE || !biquad_quiet(bq))
+		return false;
+	biquad_sleep(bq);
+	NAME(filter_at)(bq, x + dx * (size - 1), y + dy * (size - 1));
+	return true;
+}
+
+// filter the voice's mono signal and add it to the block, the filter being the only serial part
+static inline __attribute__((always_inline)) void NAME(output)(
+	float *bufL,
+	float *bufR,
+	float *mono,
+	const int size,
+	biquad_st *bq,
+	float volume, float dvolume,
+	float x, float dx,
+	float y, float dy,
+	const int quality
+){
+	if (quality >= NM_Q_FILTER){
+		// jump to the coefficients for the end of the block, and hold them
+		biquad_hold(bq);
+		NAME(filter_at)(bq, x + dx * (size - 1), y + dy * (size - 1));
+		for (int i = 0; i < size; i++)
+			mono[i] = biquad_step(bq, mono[i]);
+	}
+	else{
+		for (int i = 0; i < size; i++){
+			if (NM_FILTER_RATE == 1){
+				// every sample gets its own coefficients, exactly, to null test the glide against
+				NAME(filter_at)(bq, x + dx * i, y + dy * i);
+			}
+			else if (i % NM_FILTER_RATE == 0){
+				// compute the filter at control rate, using the parameters of the last sample in the
+				// sub-block, and glide the coefficients there
+				int n = mini(NM_FILTER_RATE, size - i);
+				biquad_st target;
+				NAME(filter_at)(&target, x + dx * (i + n - 1), y + dy * (i + n - 1));
+				biquad_glide(bq, &target, n);
+			}
+			if (NM_FILTER_RATE > 1)
+				biquad_glidestep(bq);
+			mono[i] = biquad_step(bq, mono[i]);
+		}
+	}
+
+	for (int i = 0; i < size; i++){
+		float out = (volume + i * dvolume) * mono[i];
+		bufL[i] += out;
+		bufR[i] += out;
+	}
+}
+
+#if POLY_NOTES > 1
+
+// data per voice, with the notes' state in parallel arrays
+typedef struct {
+	biquad_st bq;
+	int count; // notes sounding, including released ones that haven't finished
+	int id[POLY_NOTES]; // from noteon, so two notes with the same pitch are released separately
+	float dang[POLY_NOTES];
+	float ang[POLY_NOTES][UNISON];
+	envelope_st env[POLY_NOTES];
+} NAME(vst);
+
+// returns false if every note is taken, so the note needs another avoice
+static bool NAME(poly_noteon)(
 	NAME(vst) *vu, NAME(cst) *cu,
 	int note,
+	int id,
+	float freq,
+	float velocity,
+	float x,
+	float y
+){
+	if (vu->count >= POLY_NOTES)
+		return false;
+	if (vu->count == 0)
+		STATIC_FILTER(&vu->bq);
+	int k = vu->count++;
+	vu->id[k] = id;
+	vu->dang[k] = freq / 48000.0f;
+	for (int u = 0; u < UNISON; u++)
+		vu->ang[k][u] = (float)u / UNISON;
+	ENVELOPE_MAKE(&vu->env[k]);
+	return true;
+}
+
+static inline __attribute__((always_inline)) int NAME(poly_renderk)(
+	float *bufL,
+	float *bufR,
+	const int size,
+	NAME(vst) *vu, NAME(cst) *cu,
+	float volume, float dvolume,
+	float x, float dx,
+	float y, float dy,
+	const int quality
+){
+	bool on = vu->count > 0;
+	if (!on)
+		dvolume = -volume / size;
+
+	// notes whose envelope keeps them below NM_SILENCE for the block only move their phases on
+	float mono[NM_K];
+	memset(mono, 0, sizeof(mono));
+	float peak = 0;
+	for (int k = 0; k < vu->count; k++){
+		float envb[NM_K];
+		envelope_block(&vu->env[k], envb, size);
+		float ek = peakf(envb, size) * UNISON;
+		if (ek < NM_SILENCE){
+			NAME(advance)(vu->ang[k], vu->dang[k], size, y);
+			continue;
+		}
+		peak = maxf(peak, ek);
+		float w[NM_K];
+		NAME(generate)(w, vu->ang[k], vu->dang[k], size, y, dy, quality);
+		for (int i = 0; i < size; i++){
+			float s = w[i];
+			float env = envb[i];
+			ENVELOPE_STEP();
+			mono[i] += s;
+		}
+	}
+
+	// drop finished notes, moving the last note into the gap
+	for (int k = 0; k < vu->count; ){
+		if (envelope_done(&vu->env[k])){
+			int last = --vu->count;
+			vu->id[k] = vu->id[last];
+			vu->dang[k] = vu->dang[last];
+			memcpy(vu->ang[k], vu->ang[last], sizeof(vu->ang[k]));
+			vu->env[k] = vu->env[last];
+		}
+		else
+			k++;
+	}
+
+	if (on && NAME(sleep)(&vu->bq, peak, size, x, dx, y, dy))
+		return RENDER_QUIET;
+	NAME(output)(bufL, bufR, mono, size, &vu->bq, volume, dvolume, x, dx, y, dy, quality);
+	return on ? RENDER_WROTE : RENDER_DONE;
+}
+
+static void NAME(poly_noteoff)(
+	NAME(vst) *vu, NAME(cst) *cu,
+	int note,
+	int id,
+	float freq
+){
+	for (int k = 0; k < vu->count; k++){
+		if (vu->id[k] == id && vu->env[k].stage < ENV_RELEASE){
+			envelope_release(&vu->env[k]);
+			return;
+		}
+	}
+}
+
+#else
+
+typedef struct {
+	int note;
+	float dang;
+} NAME(note_st);
+
+// data per voice
+typedef struct {
+	biquad_st bq;
+#if OSC_STAGES > 0
+	float hb[(OSC_STAGES - 1) * HALFBAND_HIST(HALFBAND_EARLY_K) + HALFBAND_HIST(HALFBAND_FINAL_K)];
+#endif
+	envelope_st env;
+	float ang[UNISON];
+	NAME(note_st) notes[15];
+	int nextnote;
+} NAME(vst);
+
+static bool NAME(poly_noteon)(
+	NAME(vst) *vu, NAME(cst) *cu,
+	int note,
+	int id,
 	float freq,
 	float velocity,
 	float x,
@@ -56,75 +401,94 @@ static void NAME(poly_noteon)(
 	if (vu->nextnote == 0){
 		for (int u = 0; u < UNISON; u++)
 			vu->ang[u] = (float)u / UNISON;
-		STATIC_FILTER();
-		ENVELOPE_MAKE();
-	#if defined(OVERSAMPLE) && OVERSAMPLE > 1
-		for (int u = 0; u < UNISON; u++)
-			oversample_make(&vu->os[u], OVERSAMPLE);
+		STATIC_FILTER(&vu->bq);
+		ENVELOPE_MAKE(&vu->env);
+	#if OSC_STAGES > 0
+		memset(vu->hb, 0, sizeof(vu->hb));
 	#endif
 	}
 	vu->notes[vu->nextnote++] = (NAME(note_st)){ note, freq / 48000.0f };
+	return true;
 }
 
-static bool NAME(poly_render)(
-	nm_sample_st *buf,
+// size is a constant in each call from NAME(poly_render), so full blocks get their own copy of the
+// body with every loop bound folded in
+static inline __attribute__((always_inline)) int NAME(poly_renderk)(
+	float *bufL,
+	float *bufR,
+	const int size,
 	NAME(vst) *vu, NAME(cst) *cu,
 	float volume, float dvolume,
 	float x, float dx,
-	float y, float dy
+	float y, float dy,
+	const int quality
 ){
 	bool on = vu->nextnote > 0 || !envelope_done(&vu->env);
-	float dang[UNISON];
-	dang[0] = vu->notes[maxi(0, vu->nextnote - 1)].dang;
-	for (int u = 1; u < UNISON; u++)
-		dang[u] = dang[0] * UNISON_DETUNE(u);
 	if (!on)
-		dvolume = -volume / NM_K;
-	for (int i = 0; i < NM_K; i++){
-		float s = 0;
-		float env = envelope_step(&vu->env);
-		float duty;
-		DUTY();
-
-		// TODO: this is wrong -- don't up and down sample every unison oscillator, up sample
-		// everything, then down sample at the very end, all at once
-	#if defined(OVERSAMPLE) && OVERSAMPLE > 1
-		#pragma unroll
-		for (int u = 0; u < UNISON; u++){
-			#pragma unroll
-			for (int os = 0; os < OVERSAMPLE; os++){
-				float ang = fmodf(vu->ang[u] + os * dang[u] / OVERSAMPLE, 1);
-				float sv = OSC_CURVE(ang);
-				sv = oversample_step(&vu->os[u], sv);
-				if (os == 0)
-					s += sv;
-			}
+		dvolume = -volume / size;
+	float dang0 = vu->notes[maxi(0, vu->nextnote - 1)].dang;
+
+	float envb[NM_K];
+	envelope_block(&vu->env, envb, size);
+	float peak = peakf(envb, size) * UNISON;
+
+	// at 1x, a silent block only needs the phases moved on -- the decimators would need the
+	// oscillators' recent history when waking up, so oversampled voices keep generating
+#if OSC_STAGES == 0
+	if (on && NAME(sleep)(&vu->bq, peak, size, x, dx, y, dy)){
+		NAME(advance)(vu->ang, dang0, size, y);
+		return RENDER_QUIET;
+	}
+#endif
+
+	float w[NM_K * OVERSAMPLE];
+	NAME(generate)(w, vu->ang, dang0, size, y, dy, quality);
+
+	// decimate the unison sum once, ping-ponging between w and tmp until the final stage
+#if OSC_STAGES > 0
+	float osc_k[NM_K];
+	const float *osc = osc_k;
+	if (quality >= NM_Q_ALIAS){
+		// generated at 1x, so there's nothing to decimate -- the decimators start over when
+		// they're needed again
+		memset(vu->hb, 0, sizeof(vu->hb));
+		osc = w;
+	}
+	else{
+		float tmp[NM_K * OVERSAMPLE / 2];
+		float *src = w;
+		#pragma GCC unroll 4
+		for (int st = 0; st < OSC_STAGES - 1; st++){
+			float *dst = st & 1 ? w : tmp;
+			halfband_decimate(&vu->hb[st * HALFBAND_HIST(HALFBAND_EARLY_K)], halfband_early,
+				HALFBAND_EARLY_K, src, (size * OVERSAMPLE) >> st, dst);
+			src = dst;
 		}
-	#else
-		for (int u = 0; u < UNISON; u++)
-			s += OSC_CURVE(vu->ang[u]);
-	#endif
+		halfband_decimate(&vu->hb[(OSC_STAGES - 1) * HALFBAND_HIST(HALFBAND_EARLY_K)],
+			halfband_final, HALFBAND_FINAL_K, src, size * 2, osc_k);
+	}
+	if (on && NAME(sleep)(&vu->bq, peak, size, x, dx, y, dy))
+		return RENDER_QUIET;
+#else
+	const float *osc = w;
+#endif
 
+	float mono[NM_K];
+	for (int i = 0; i < size; i++){
+		float s = osc[i];
+		float env = envb[i];
 		ENVELOPE_STEP();
-		nm_sample_st out = { s, s };
-		PARAM_FILTER();
-		out = biquad_step(&vu->bq, out);
-
-		buf[i].L += volume * out.L;
-		buf[i].R += volume * out.R;
-		#pragma unroll
-		for (int u = 0; u < UNISON; u++)
-			vu->ang[u] = fmodf(vu->ang[u] + dang[u], 1);
-		volume += dvolume;
-		x += dx;
-		y += dy;
+		mono[i] = s;
 	}
-	return on;
+
+	NAME(output)(bufL, bufR, mono, size, &vu->bq, volume, dvolume, x, dx, y, dy, quality);
+	return on ? RENDER_WROTE : RENDER_DONE;
 }
 
 static void NAME(poly_noteoff)(
 	NAME(vst) *vu, NAME(cst) *cu,
 	int note,
+	int id,
 	float freq
 ){
 	for (int i = 0; i < vu->nextnote; i++){
@@ -141,6 +505,43 @@ static void NAME(poly_noteoff)(
 	}
 }
 
+#endif
+
+static int NAME(poly_render)(
+	float *bufL,
+	float *bufR,
+	int size,
+	NAME(vst) *vu, NAME(cst) *cu,
+	float volume, float dvolume,
+	float x, float dx,
+	float y, float dy,
+	int quality
+){
+	if (size == NM_K){
+		return NAME(poly_renderk)(bufL, bufR, NM_K, vu, cu, volume, dvolume, x, dx, y, dy,
+			quality);
+	}
+	return NAME(poly_renderk)(bufL, bufR, size, vu, cu, volume, dvolume, x, dx, y, dy, quality);
+}
+
 #ifdef __OSC__UNDEF__CURVE__
+	#undef __OSC__UNDEF__CURVE__
 	#undef OSC_CURVE
 #endif
+
+#ifdef __OSC__UNDEF__CURVE_NAIVE__
+	#undef __OSC__UNDEF__CURVE_NAIVE__
+	#undef OSC_CURVE_NAIVE
+#endif
+
+#undef OSC_STAGES
+
+#ifdef __OSC__UNDEF__POLY_NOTES__
+	#undef __OSC__UNDEF__POLY_NOTES__
+	#undef POLY_NOTES
+#endif
+
+#ifdef __OSC__UNDEF__OVERSAMPLE__
+	#undef __OSC__UNDEF__OVERSAMPLE__
+	#undef OVERSAMPLE
+#endif
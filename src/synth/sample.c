@@ -0,0 +1,76 @@
+// (c) Copyright 2020, Sean Connelly (@velipso), sean.cm
+// MIT License
+// Project Home: https://github.com/velipso/nightmare
+
+// every note plays one of the voice's samples in its own avoice, picked by the note number (0 for
+// the first sample, up to 14), at the clip's nm_samplespeed
+// with SAMPLE_FADE, releasing the note fades the sample out over that many seconds, otherwise the
+// sample plays to the end like a one-shot
+
+// data per clip
+typedef struct {
+	int dummy;
+} NAME(cst);
+
+// data per voice
+typedef struct {
+	sampler_st sm;
+	float gain;
+	float fade;  // ramps from 1 to 0 once the note is released
+	float dfade; // per sample
+} NAME(vst);
+
+static void NAME(sample_build)(
+	NAME(cst) *cu,
+	float out,
+	float x,
+	float y
+){
+}
+
+static bool NAME(sample_noteon)(
+	NAME(vst) *vu, NAME(cst) *cu,
+	const sample_st *smp,
+	nm_samplespeed speed,
+	float velocity,
+	float x,
+	float y
+){
+	if (!sampler_start(&vu->sm, smp, speed))
+		return false;
+	vu->gain = velocity;
+	vu->fade = 1;
+	vu->dfade = 0;
+	return true;
+}
+
+static void NAME(sample_noteoff)(
+	NAME(vst) *vu, NAME(cst) *cu
+){
+#ifdef SAMPLE_FADE
+	vu->dfade = -1.0f / (SAMPLE_FADE * 48000.0f);
+#endif
+}
+
+static int NAME(sample_render)(
+	float *bufL,
+	float *bufR,
+	int size,
+	NAME(vst) *vu, NAME(cst) *cu,
+	float volume, float dvolume,
+	float x, float dx,
+	float y, float dy,
+	int quality
+){
+	// fold the note's gain into the volume ramp, and end the note once it fades under NM_SILENCE
+	float g0 = vu->gain * vu->fade;
+	vu->fade = maxf(0, vu->fade + vu->dfade * size);
+	float g1 = vu->gain * vu->fade;
+	float v0 = volume * g0;
+	float v1 = (volume + dvolume * size) * g1;
+	if (g0 <= NM_SILENCE || !sampler_render(&vu->sm, bufL, bufR, size, v0, (v1 - v0) / size)){
+		sampler_stop(&vu->sm);
+		return RENDER_DONE;
+	}
+	return RENDER_WROTE;
+}
@@ -5,9 +5,10 @@
 #define NAME(n)                v1001_ ## n
 #define UNISON                 1
 #define UNISON_DETUNE(u)       1
-#define STATIC_FILTER()        biquad_lowpass(&vu->bq, 60.0f + x * 2000.0f, 0)
-#define PARAM_FILTER()         biquad_lowpass(&vu->bq, 60.0f + x * 2000.0f, 0)
-#define ENVELOPE_MAKE()        envelope_make(&vu->env, 0, 0.01f, 0, 0.1f, 0.5f, 0.2f)
+#define STATIC_FILTER(bq)      biquad_lowpass(bq, 60.0f + x * 2000.0f, 0)
+#define PARAM_FILTER(bq)       biquad_lowpass(bq, 60.0f + x * 2000.0f, 0)
+#define ENVELOPE_MAKE(env)     envelope_make(env, 0, 0.01f, 0, 0.1f, 0.5f, 0.2f, \
+                               ENVELOPE_LINEAR)
 #define ENVELOPE_STEP()        s *= env
 #define OSC_SQUARE
 #define OVERSAMPLE             8
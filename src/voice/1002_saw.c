@@ -5,12 +5,14 @@
 #define NAME(n)                v1002_ ## n
 #define UNISON                 5
 #define UNISON_DETUNE(u)       (1 + ((u & 1) ? -1 : 1) * 0.003f * u * u * (y + 0.01f))
-#define STATIC_FILTER()        biquad_lowpass(&vu->bq, 60.0f + x * 2000.0f, 0)
-#define PARAM_FILTER()         biquad_lowpass(&vu->bq, 60.0f + x * 2000.0f, 0)
-#define ENVELOPE_MAKE()        envelope_make(&vu->env, 0, 0.1f, 0, 0.1f, 0.5f, 0.2f)
+#define STATIC_FILTER(bq)      biquad_lowpass(bq, 60.0f + x * 2000.0f, 0)
+#define PARAM_FILTER(bq)       biquad_lowpass(bq, 60.0f + x * 2000.0f, 0)
+#define ENVELOPE_MAKE(env)     envelope_make(env, 0, 0.1f, 0, 0.1f, 0.5f, 0.2f, \
+                               ENVELOPE_LINEAR)
 #define ENVELOPE_STEP()        s *= env
 #define OSC_SAW
-#define OVERSAMPLE             2
+#define OSC_POLYBLEP
+#define POLY_NOTES             6
 #define DUTY()
 
 #include "../synth/osc.c"
@@ -24,7 +26,8 @@ VABOUT_POLY(
 );
 
 #undef DUTY
-#undef OVERSAMPLE
+#undef POLY_NOTES
+#undef OSC_POLYBLEP
 #undef OSC_SAW
 #undef ENVELOPE_STEP
 #undef ENVELOPE_MAKE
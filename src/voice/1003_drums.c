@@ -0,0 +1,24 @@
+// (c) Copyright 2020, Sean Connelly (@velipso), sean.cm
+// MIT License
+// Project Home: https://github.com/velipso/nightmare
+
+#define NAME(n)                v1003_ ## n
+#define SAMPLE_FADE            0.05f
+
+#include "../synth/sample.c"
+
+VABOUT_SAMPLE(
+	1003,
+	NM_VC_DRUMS,
+	"Drums",
+	"Test X:", 50,
+	"Test Y:", 50,
+	"drums_kick",
+	"drums_snare",
+	"drums_hatclosed",
+	"drums_hatopen",
+	"drums_clap"
+);
+
+#undef SAMPLE_FADE
+#undef NAME